@@ -0,0 +1,197 @@
+// Measures requests per second, throughput, latency and memory per request for several kinds of requests.
+// Run extras/benchmark_server.py on a host in the same network and set SERVER to its address.
+// Run it with --profile lossy or other network profiles to measure behavior on bad links.
+// extras/fuzz/benchmark runs the same requests on the host, in virtual time, under each network profile, and
+// also counts allocations.
+
+#include <algorithm>
+
+#include <WiFi.h>
+
+#include <AsyncHTTPRequest.h>
+
+#define WIFI_SSID "ssid"
+#define WIFI_PASSWORD "password"
+#define SERVER "http://192.168.1.2:8080"
+
+#define MAX_REQUESTS 8 // highest concurrency
+#define UPLOAD_SIZE 65536
+
+struct Shape {
+    const char* name;
+    const char* method;
+    const char* path;
+    size_t concurrency;
+    size_t count;
+    size_t read_rate; // bytes read per ms with read(), 0 to pass the body to a sink
+};
+
+static const Shape shapes[] = {
+    {"small GET", "GET", "/small", 1, 200, 0},
+    {"large GET", "GET", "/large?size=1048576", 1, 5, 0},
+    {"chunked GET", "GET", "/chunked?size=1048576", 1, 5, 0},
+    {"POST upload", "POST", "/upload", 1, 20, 0},
+    {"concurrent GET", "GET", "/small", 4, 200, 0},
+    {"slow reader", "GET", "/large?size=262144", 1, 5, 32},
+    {"slow readers", "GET", "/large?size=262144", 4, 8, 8}
+};
+
+// Counts the body without keeping it.
+class CountingSink: public AsyncHTTPRequest::Sink {
+public:
+    bool write(const char* data, size_t length) override { (void)data; bytes += length; return true; }
+
+    size_t bytes = 0;
+};
+
+struct Running {
+    AsyncHTTPRequest* request = nullptr;
+    CountingSink sink;
+    size_t bytes_read = 0;
+};
+
+static Running running[MAX_REQUESTS];
+static uint32_t latencies[1024];
+static size_t measured = 0;
+
+static size_t shape_index = 0;
+static size_t started = 0;
+static size_t finished = 0;
+static size_t failed = 0;
+static uint64_t bytes = 0;
+static uint64_t peak_memory = 0;
+static uint32_t start_time = 0;
+
+
+static void startRequest(Running* slot, const Shape& shape) {
+    slot->request = new AsyncHTTPRequest();
+    slot->sink.bytes = 0;
+    slot->bytes_read = 0;
+    if (shape.read_rate == 0) {
+        slot->request->setSink(&slot->sink);
+    }
+    else {
+        // Having a handler enables flow control.
+        slot->request->onReceivedData([](AsyncHTTPRequest* request) { (void)request; });
+    }
+    slot->request->setResumable(3);
+
+    auto url = String(SERVER) + shape.path;
+    AsyncHTTPRequest::Buffer* body = nullptr;
+    if (strcmp(shape.method, "POST") == 0) {
+        // The request deletes the body.
+        body = new AsyncHTTPRequest::Buffer();
+        char block[256];
+        for (size_t i = 0; i < sizeof(block); i++) {
+            block[i] = i;
+        }
+        for (size_t i = 0; i < UPLOAD_SIZE; i += sizeof(block)) {
+            body->write(block, sizeof(block));
+        }
+    }
+    // Failures are counted when the request is finished.
+    slot->request->send(shape.method, url.c_str(), "application/octet-stream", body);
+    started += 1;
+}
+
+
+static void finishRequest(Running* slot) {
+    auto request = slot->request;
+    auto& timing = request->timing();
+
+    if (request->error() != AsyncHTTPRequest::ERROR_OK || request->status() != 200) {
+        failed += 1;
+    }
+    else if (measured < sizeof(latencies) / sizeof(latencies[0])) {
+        latencies[measured++] = timing.finished - timing.started;
+    }
+    if (request->error() == AsyncHTTPRequest::ERROR_OK) {
+        bytes += slot->sink.bytes + slot->bytes_read;
+    }
+    peak_memory += request->memoryUsage().peak();
+    finished += 1;
+
+    delete request;
+    slot->request = nullptr;
+}
+
+
+static void report(const Shape& shape) {
+    auto elapsed = (millis() - start_time) / 1000.0;
+    std::sort(latencies, latencies + measured);
+
+    Serial.printf("%-16s %5u requests, %u failed, %.1f requests/s, %.3f MB/s", shape.name, static_cast<unsigned int>(finished), static_cast<unsigned int>(failed), finished / elapsed, bytes / elapsed / 1e6);
+    if (measured > 0) {
+        Serial.printf(", latency p50 %.1f ms, p99 %.1f ms", latencies[measured / 2] / 1000.0, latencies[measured * 99 / 100] / 1000.0);
+    }
+    Serial.printf(", peak memory %u bytes/request\n", static_cast<unsigned int>(peak_memory / finished));
+    Serial.printf("%-16s total peak memory %u bytes, most bytes queued %u, %u ACKs delayed, %u resumes\n", "",
+                  static_cast<unsigned int>(AsyncHTTPRequest::memory.peak()),
+                  static_cast<unsigned int>(AsyncHTTPRequest::metrics.get(AsyncHTTPRequest::Metrics::BUFFER_HIGH_WATER)),
+                  static_cast<unsigned int>(AsyncHTTPRequest::metrics.get(AsyncHTTPRequest::Metrics::ACKS_DELAYED)),
+                  static_cast<unsigned int>(AsyncHTTPRequest::metrics.get(AsyncHTTPRequest::Metrics::RESUMES)));
+}
+
+
+void setup() {
+    Serial.begin(115200);
+
+    WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+    while (WiFi.status() != WL_CONNECTED) {
+        delay(100);
+    }
+    Serial.println("Connected");
+    start_time = millis();
+}
+
+
+void loop() {
+    if (shape_index >= sizeof(shapes) / sizeof(shapes[0])) {
+        while (true) {
+            delay(1000);
+        }
+    }
+
+    auto& shape = shapes[shape_index];
+    auto active = 0;
+
+    for (size_t i = 0; i < shape.concurrency; i++) {
+        auto slot = &running[i];
+        if (slot->request != nullptr) {
+            auto complete = slot->request->isComplete();
+            if (shape.read_rate > 0) {
+                char data[64];
+                size_t n = 0;
+                size_t length;
+                while (n < shape.read_rate && (length = slot->request->read(data, std::min(sizeof(data), shape.read_rate - n))) > 0) {
+                    n += length;
+                }
+                slot->bytes_read += n;
+                if (n == shape.read_rate) {
+                    // There may be more data to read.
+                    complete = false;
+                }
+            }
+            if (complete) {
+                finishRequest(slot);
+            }
+        }
+        if (slot->request == nullptr && started < shape.count) {
+            startRequest(slot, shape);
+        }
+        if (slot->request != nullptr) {
+            active += 1;
+        }
+    }
+
+    if (active == 0) {
+        report(shape);
+        shape_index += 1;
+        started = finished = failed = measured = 0;
+        bytes = peak_memory = 0;
+        AsyncHTTPRequest::metrics.reset();
+        AsyncHTTPRequest::memory.resetPeak();
+        start_time = millis();
+    }
+    delay(1);
+}
@@ -0,0 +1,179 @@
+#!/usr/bin/env python3
+
+# HTTP/1.1 server for examples/Benchmark that can simulate a bad network. extras/fuzz/benchmark serves the same
+# paths in process for the host build, with the same profiles in extras/fuzz/host/network.cpp.
+#
+# usage: benchmark_server.py [options] [port]
+#
+#   GET /small          100 bytes
+#   GET /large?size=n   n bytes (default 1 MiB) with Content-Length, supports Range
+#   GET /chunked?size=n n bytes (default 1 MiB) in 1460 byte chunks
+#   POST /upload        discards the body
+#
+# Network profiles (see --help) delay responses, cap bandwidth, send bodies in random segment sizes,
+# drop connections in the middle of bodies and read uploads slowly, which delays the ACKs the client gets.
+
+import argparse
+import random
+import re
+import socket
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlparse
+
+PATTERN = bytes(range(256)) * 64
+
+PROFILES = {
+    "lan": {},
+    "wan": {"latency": 50, "rate": 1000000},
+    "lossy": {"latency": 100, "rate": 250000, "segment": (1, 1460), "disconnect": 0.002},
+    "slow-upload": {"slow_read": 20000},
+}
+
+options = None
+
+
+def body_of(size, offset=0):
+    while size > 0:
+        start = offset % len(PATTERN)
+        piece = PATTERN[start:start + size]
+        size -= len(piece)
+        offset += len(piece)
+        yield piece
+
+
+class Dropped(Exception):
+    pass
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def setup(self):
+        super().setup()
+        if options.segment:
+            self.connection.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+    def do_GET(self):
+        url = urlparse(self.path)
+        size = int(parse_qs(url.query).get("size", [1 << 20])[0])
+        self.delay()
+        try:
+            if url.path == "/small":
+                self.send_body(100)
+            elif url.path == "/large":
+                self.send_range(size)
+            elif url.path == "/chunked":
+                self.send_response(200)
+                self.send_header("Content-Type", "application/octet-stream")
+                self.send_header("Transfer-Encoding", "chunked")
+                self.end_headers()
+                for piece in body_of(size):
+                    for i in range(0, len(piece), 1460):
+                        chunk = piece[i:i + 1460]
+                        self.send(b"%x\r\n%s\r\n" % (len(chunk), chunk))
+                self.send(b"0\r\n\r\n")
+            else:
+                self.send_error(404)
+        except Dropped:
+            self.close_connection = True
+
+    def do_POST(self):
+        if urlparse(self.path).path != "/upload":
+            self.send_error(404)
+            return
+        length = int(self.headers.get("Content-Length", 0))
+        while length > 0:
+            n = len(self.rfile.read(min(length, 1460 if options.slow_read else 65536)))
+            if n == 0:
+                return
+            length -= n
+            if options.slow_read:
+                time.sleep(n / options.slow_read)
+        self.delay()
+        self.send_body(0)
+
+    def send_range(self, size):
+        first, last = 0, size - 1
+        match = re.fullmatch(r"bytes=(\d+)-(\d*)", self.headers.get("Range", ""))
+        if match and self.headers.get("If-Range", self.etag(size)) == self.etag(size):
+            first = int(match.group(1))
+            if match.group(2):
+                last = min(int(match.group(2)), size - 1)
+            if first > last:
+                self.send_error(416)
+                return
+            self.send_response(206)
+            self.send_header("Content-Range", f"bytes {first}-{last}/{size}")
+        else:
+            self.send_response(200)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(last + 1 - first))
+        self.send_header("ETag", self.etag(size))
+        self.send_header("Accept-Ranges", "bytes")
+        self.end_headers()
+        for piece in body_of(last + 1 - first, first):
+            self.send(piece)
+
+    def send_body(self, size):
+        self.send_response(200)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(size))
+        self.end_headers()
+        for piece in body_of(size):
+            self.send(piece)
+
+    def send(self, data):
+        while data:
+            n = random.randint(*options.segment) if options.segment else len(data)
+            segment, data = data[:n], data[n:]
+            if options.disconnect and random.random() < options.disconnect:
+                self.connection.shutdown(socket.SHUT_RDWR)
+                raise Dropped()
+            self.wfile.write(segment)
+            if options.segment:
+                self.wfile.flush()
+            if options.rate:
+                time.sleep(len(segment) / options.rate)
+
+    def delay(self):
+        if options.latency:
+            time.sleep(options.latency / 1000)
+
+    @staticmethod
+    def etag(size):
+        return f'"benchmark-{size}"'
+
+    def log_message(self, format, *args):
+        pass
+
+
+def segment_range(value):
+    low, _, high = value.partition(":")
+    return int(low), int(high or low)
+
+
+def main():
+    global options
+
+    parser = argparse.ArgumentParser(description="HTTP server for examples/Benchmark")
+    parser.add_argument("port", type=int, nargs="?", default=8080)
+    parser.add_argument("--profile", choices=PROFILES.keys(), help="preset for the options below")
+    parser.add_argument("--latency", type=int, default=0, help="delay before each response in ms")
+    parser.add_argument("--rate", type=int, default=0, help="bandwidth cap in bytes/s")
+    parser.add_argument("--segment", type=segment_range, help="send bodies in segments of MIN[:MAX] bytes")
+    parser.add_argument("--disconnect", type=float, default=0, help="probability of dropping the connection per segment")
+    parser.add_argument("--slow-read", type=int, default=0, help="read uploads at this many bytes/s")
+    parser.add_argument("--seed", type=int, help="random seed")
+    options = parser.parse_args()
+    if options.profile:
+        parser.set_defaults(**PROFILES[options.profile])
+        options = parser.parse_args()
+    if options.seed is not None:
+        random.seed(options.seed)
+
+    ThreadingHTTPServer(("", options.port), Handler).serve_forever()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+
+# Decodes a dump written by AsyncHTTPRequest::Trace::dump().
+#
+# usage: decode_trace.py dump [AsyncHTTPRequest.h]
+#
+# Event names are taken from the Trace::Event enum in the header.
+
+import os
+import re
+import struct
+import sys
+
+
+def read_events(header):
+    with open(header) as file:
+        text = file.read()
+    match = re.search(r"class Trace \{.*?enum Event \{(.*?)\};", text, re.S)
+    if not match:
+        sys.exit(f"{header}: Trace::Event not found")
+    body = re.sub(r"//[^\n]*", "", match.group(1))
+    return [name.strip() for name in body.split(",") if name.strip()]
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        sys.exit(f"usage: {sys.argv[0]} dump [AsyncHTTPRequest.h]")
+    header = sys.argv[2] if len(sys.argv) == 3 else os.path.join(os.path.dirname(__file__), "..", "src", "AsyncHTTPRequest.h")
+    events = read_events(header)
+
+    with open(sys.argv[1], "rb") as file:
+        data = file.read()
+    start = data.find(b"HTRC")
+    if start < 0 or len(data) < start + 8:
+        sys.exit(f"{sys.argv[1]}: no trace found")
+    version, record_size, count = struct.unpack_from("<BBH", data, start + 4)
+    if version != 1 or record_size != 16:
+        sys.exit(f"{sys.argv[1]}: unsupported trace version {version}")
+
+    offset = start + 8
+    first_time = None
+    for _ in range(count):
+        if offset + record_size > len(data):
+            sys.exit(f"{sys.argv[1]}: trace truncated")
+        time, event, request, arg1, arg2 = struct.unpack_from("<IHHii", data, offset)
+        offset += record_size
+        if first_time is None:
+            first_time = time
+        name = events[event] if event < len(events) else f"unknown({event})"
+        elapsed = (time - first_time) & 0xffffffff
+        print(f"{elapsed / 1000:12.3f} ms  #{request:<5} {name:<24} {arg1} {arg2}")
+
+
+if __name__ == "__main__":
+    main()
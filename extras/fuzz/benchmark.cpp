@@ -0,0 +1,376 @@
+// Runs the request shapes of examples/Benchmark against an in-process server over the simulated network in
+// host/network.h, once for each network profile. Requests/s, MB/s and latency are in virtual time, so they only
+// change when the library sends, acknowledges or reads differently. Allocations and CPU time per request measure
+// the library itself.
+//
+//     benchmark [divisor [profile]]    divide the request counts by divisor for a quick run
+//
+// Requests may fail on profiles that drop connections, and downloads without ranges can't be resumed. Elsewhere
+// any failure or stall makes it exit with 1.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "AsyncHTTPRequest.h"
+#include "allocations.h"
+#include "network.h"
+
+namespace {
+
+const size_t upload_size = 65536;
+const unsigned long stall_limit = 600000; // ms of virtual time for one shape
+
+struct Shape {
+    const char* name;
+    const char* method;
+    const char* path;
+    size_t concurrency;
+    size_t count;
+    size_t read_rate; // bytes read per ms with read(), 0 to pass the body to a sink
+};
+
+const Shape shapes[] = {
+    {"small GET", "GET", "/small", 1, 200, 0},
+    {"large GET", "GET", "/large?size=1048576", 1, 5, 0},
+    {"chunked GET", "GET", "/chunked?size=1048576", 1, 5, 0},
+    {"POST upload", "POST", "/upload", 1, 20, 0},
+    {"concurrent GET", "GET", "/small", 4, 200, 0},
+    {"slow reader", "GET", "/large?size=262144", 1, 5, 32},
+    {"slow readers", "GET", "/large?size=262144", 4, 8, 8}
+};
+
+// Serves the paths of extras/benchmark_server.py.
+class Server: public Network::Session {
+public:
+    void receive(const char* data, size_t length, std::string* output) override {
+        input.append(data, length);
+        while (true) {
+            if (!have_header) {
+                auto end = input.find("\r\n\r\n");
+                if (end == std::string::npos) {
+                    return;
+                }
+                parseHeader(input.substr(0, end + 2));
+                input.erase(0, end + 4);
+                have_header = true;
+            }
+            // Uploads are discarded.
+            auto n = std::min(body_remaining, input.size());
+            input.erase(0, n);
+            body_remaining -= n;
+            if (body_remaining > 0) {
+                return;
+            }
+            respond(output);
+            have_header = false;
+        }
+    }
+
+private:
+    void parseHeader(const std::string& header) {
+        auto line_end = header.find("\r\n");
+        auto request_line = header.substr(0, line_end);
+        auto space = request_line.find(' ');
+        method = request_line.substr(0, space);
+        target = request_line.substr(space + 1, request_line.find(' ', space + 1) - space - 1);
+        body_remaining = 0;
+        range.clear();
+        if_range.clear();
+
+        for (auto start = line_end + 2; start < header.size(); start = line_end + 2) {
+            line_end = header.find("\r\n", start);
+            auto line = header.substr(start, line_end - start);
+            auto colon = line.find(':');
+            if (colon == std::string::npos) {
+                continue;
+            }
+            auto name = line.substr(0, colon);
+            auto value = line.substr(line.find_first_not_of(' ', colon + 1));
+            if (strcasecmp(name.c_str(), "Content-Length") == 0) {
+                body_remaining = strtoul(value.c_str(), nullptr, 10);
+            }
+            else if (strcasecmp(name.c_str(), "Range") == 0) {
+                range = value;
+            }
+            else if (strcasecmp(name.c_str(), "If-Range") == 0) {
+                if_range = value;
+            }
+        }
+    }
+
+    void respond(std::string* output) {
+        auto query = target.find('?');
+        auto path = target.substr(0, query);
+        size_t size = 1 << 20;
+        if (query != std::string::npos && target.compare(query + 1, 5, "size=") == 0) {
+            size = strtoul(target.c_str() + query + 6, nullptr, 10);
+        }
+
+        if (method == "GET" && path == "/small") {
+            sendBody(output, 100);
+        }
+        else if (method == "GET" && path == "/large") {
+            sendRange(output, size);
+        }
+        else if (method == "GET" && path == "/chunked") {
+            *output += "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nTransfer-Encoding: chunked\r\n\r\n";
+            for (size_t offset = 0; offset < size; offset += 1460) {
+                auto length = std::min(size - offset, static_cast<size_t>(1460));
+                char chunk_header[16];
+                snprintf(chunk_header, sizeof(chunk_header), "%zx\r\n", length);
+                *output += chunk_header;
+                appendBody(output, length, offset);
+                *output += "\r\n";
+            }
+            *output += "0\r\n\r\n";
+        }
+        else if (method == "POST" && path == "/upload") {
+            sendBody(output, 0);
+        }
+        else {
+            *output += "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        }
+    }
+
+    void sendBody(std::string* output, size_t size) {
+        *output += "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: " + std::to_string(size) + "\r\n\r\n";
+        appendBody(output, size, 0);
+    }
+
+    void sendRange(std::string* output, size_t size) {
+        auto etag = "\"benchmark-" + std::to_string(size) + "\"";
+        size_t first = 0;
+        size_t last = size - 1;
+        unsigned long range_first, range_last;
+        int end;
+        auto partial = sscanf(range.c_str(), "bytes=%lu-%n", &range_first, &end) == 1 && (if_range.empty() || if_range == etag);
+        if (partial) {
+            first = range_first;
+            if (sscanf(range.c_str() + end, "%lu", &range_last) == 1) {
+                last = std::min(static_cast<size_t>(range_last), size - 1);
+            }
+            if (first > last) {
+                *output += "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Length: 0\r\n\r\n";
+                return;
+            }
+            *output += "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes " + std::to_string(first) + "-" + std::to_string(last) + "/" + std::to_string(size) + "\r\n";
+        }
+        else {
+            *output += "HTTP/1.1 200 OK\r\n";
+        }
+        *output += "Content-Type: application/octet-stream\r\nContent-Length: " + std::to_string(last + 1 - first) + "\r\nETag: " + etag + "\r\nAccept-Ranges: bytes\r\n\r\n";
+        appendBody(output, last + 1 - first, first);
+    }
+
+    static void appendBody(std::string* output, size_t size, size_t offset) {
+        for (size_t i = 0; i < size; i++) {
+            *output += static_cast<char>((offset + i) % 256);
+        }
+    }
+
+    std::string input;
+    bool have_header = false;
+    std::string method;
+    std::string target;
+    size_t body_remaining = 0;
+    std::string range;
+    std::string if_range;
+};
+
+// Counts the body without keeping it.
+class CountingSink: public AsyncHTTPRequest::Sink {
+public:
+    bool write(const char* data, size_t length) override { (void)data; bytes += length; return true; }
+
+    size_t bytes = 0;
+};
+
+struct Running {
+    AsyncHTTPRequest* request = nullptr;
+    CountingSink sink;
+    size_t bytes_read = 0;
+};
+
+struct Totals {
+    size_t started = 0;
+    size_t finished = 0;
+    size_t failed = 0;
+    uint64_t bytes = 0;
+    uint64_t peak_memory = 0;
+    std::vector<uint32_t> latencies;
+};
+
+void startRequest(Running* slot, const Shape& shape, Totals* totals) {
+    auto url = std::string("http://benchmark.test") + shape.path;
+    AsyncHTTPRequest::Buffer* body = nullptr;
+    if (strcmp(shape.method, "POST") == 0) {
+        // The request deletes the body.
+        body = new AsyncHTTPRequest::Buffer();
+        char block[256];
+        for (size_t i = 0; i < sizeof(block); i++) {
+            block[i] = i;
+        }
+        for (size_t i = 0; i < upload_size; i += sizeof(block)) {
+            body->write(block, sizeof(block));
+        }
+    }
+
+    CountAllocations counting;
+    slot->request = new AsyncHTTPRequest();
+    slot->sink.bytes = 0;
+    slot->bytes_read = 0;
+    if (shape.read_rate == 0) {
+        slot->request->setSink(&slot->sink);
+    }
+    else {
+        // Having a handler enables flow control.
+        slot->request->onReceivedData([](AsyncHTTPRequest* request) { (void)request; });
+    }
+    slot->request->setResumable(3);
+    // Failures are counted when the request is finished.
+    slot->request->send(shape.method, url.c_str(), "application/octet-stream", body);
+    totals->started += 1;
+}
+
+void finishRequest(Running* slot, Totals* totals) {
+    auto request = slot->request;
+    auto& timing = request->timing();
+
+    if (request->error() != AsyncHTTPRequest::ERROR_OK || request->status() != 200) {
+        totals->failed += 1;
+    }
+    else {
+        totals->latencies.push_back(timing.finished - timing.started);
+    }
+    if (request->error() == AsyncHTTPRequest::ERROR_OK) {
+        totals->bytes += slot->sink.bytes + slot->bytes_read;
+    }
+    totals->peak_memory += request->memoryUsage().peak();
+    totals->finished += 1;
+
+    CountAllocations counting;
+    delete request;
+    slot->request = nullptr;
+}
+
+// Returns the number of failed requests.
+size_t run(const Shape& shape, const Network::Profile& profile, size_t divisor) {
+    Network network([]() { return new Server(); }, profile);
+    std::vector<Running> running(shape.concurrency);
+    Totals totals;
+    auto count = std::max(shape.count / divisor, static_cast<size_t>(1));
+
+    AsyncHTTPRequest::metrics.reset();
+    AsyncHTTPRequest::memory.resetPeak();
+    host_allocations = 0;
+    auto start_time = millis();
+    auto cpu_start = clock();
+    bool stalled = false;
+
+    while (true) {
+        network.step();
+        size_t active = 0;
+
+        for (auto& slot : running) {
+            if (slot.request != nullptr) {
+                auto complete = slot.request->isComplete();
+                if (shape.read_rate > 0) {
+                    CountAllocations counting;
+                    char data[64];
+                    size_t n = 0;
+                    size_t length;
+                    while (n < shape.read_rate && (length = slot.request->read(data, std::min(sizeof(data), shape.read_rate - n))) > 0) {
+                        n += length;
+                    }
+                    slot.bytes_read += n;
+                    if (n == shape.read_rate) {
+                        // There may be more data to read.
+                        complete = false;
+                    }
+                }
+                if (complete) {
+                    finishRequest(&slot, &totals);
+                }
+            }
+            if (slot.request == nullptr && totals.started < count) {
+                startRequest(&slot, shape, &totals);
+            }
+            if (slot.request != nullptr) {
+                active += 1;
+            }
+        }
+
+        if (active == 0) {
+            break;
+        }
+        if (millis() - start_time > stall_limit) {
+            stalled = true;
+            for (auto& slot : running) {
+                if (slot.request != nullptr) {
+                    slot.request->abort();
+                    finishRequest(&slot, &totals);
+                }
+            }
+            break;
+        }
+    }
+
+    auto elapsed = (millis() - start_time) / 1000.0;
+    auto cpu = static_cast<double>(clock() - cpu_start) / CLOCKS_PER_SEC;
+    auto& latencies = totals.latencies;
+    std::sort(latencies.begin(), latencies.end());
+
+    printf("%-16s %5zu requests, %zu failed, %.1f requests/s, %.3f MB/s", shape.name, totals.finished, totals.failed, totals.finished / elapsed, totals.bytes / elapsed / 1e6);
+    if (!latencies.empty()) {
+        printf(", latency p50 %.1f ms, p99 %.1f ms", latencies[latencies.size() / 2] / 1000.0, latencies[latencies.size() * 99 / 100] / 1000.0);
+    }
+    printf("\n%-16s %.1f allocations/request, peak memory %zu bytes/request, %.1f us CPU/request\n", "",
+           static_cast<double>(host_allocations) / totals.finished,
+           static_cast<size_t>(totals.peak_memory / totals.finished),
+           cpu * 1e6 / totals.finished);
+    printf("%-16s total peak memory %zu bytes, most bytes queued %zu, %zu ACKs delayed, %zu disconnects, %zu resumes\n", "",
+           static_cast<size_t>(AsyncHTTPRequest::memory.peak()),
+           static_cast<size_t>(AsyncHTTPRequest::metrics.get(AsyncHTTPRequest::Metrics::BUFFER_HIGH_WATER)),
+           static_cast<size_t>(AsyncHTTPRequest::metrics.get(AsyncHTTPRequest::Metrics::ACKS_DELAYED)),
+           network.disconnects,
+           static_cast<size_t>(AsyncHTTPRequest::metrics.get(AsyncHTTPRequest::Metrics::RESUMES)));
+    if (stalled) {
+        printf("FAIL %s, %s: stalled\n", profile.name, shape.name);
+        return totals.failed + 1;
+    }
+    return profile.disconnect > 0 ? 0 : totals.failed;
+}
+
+}
+
+
+int main(int argc, char** argv) {
+    size_t divisor = argc > 1 ? std::max(atoi(argv[1]), 1) : 1;
+    auto profile_name = argc > 2 ? argv[2] : nullptr;
+
+    // Timings of 0 mean not reached.
+    delay(1);
+
+    size_t failed = 0;
+    auto found = false;
+    for (size_t i = 0; i < Network::profile_count; i++) {
+        auto& profile = Network::profiles[i];
+        if (profile_name != nullptr && strcmp(profile.name, profile_name) != 0) {
+            continue;
+        }
+        found = true;
+        printf("%s:\n", profile.name);
+        for (auto& shape : shapes) {
+            failed += run(shape, profile, divisor);
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "unknown profile %s\n", profile_name);
+        return 1;
+    }
+    return failed > 0 ? 1 : 0;
+}
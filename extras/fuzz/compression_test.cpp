@@ -0,0 +1,277 @@
+// Checks Inflater and Deflater against the system zlib, in both directions: streams compressed by zlib with
+// various levels, strategies and window sizes must inflate to the original, and streams from Deflater must be
+// accepted by zlib. Input is passed in random pieces. Corrupted streams must fail where zlib fails, and give
+// zlib's output where it doesn't.
+//
+//     compression_test [iterations [seed]]
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#include "AsyncHTTPRequest.h"
+
+namespace {
+
+class StringSink: public AsyncHTTPRequest::Sink {
+public:
+    bool write(const char* data, size_t length) override { this->data.append(data, length); return true; }
+
+    std::string data;
+};
+
+uint32_t random_state = 1;
+
+uint32_t random(uint32_t limit) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state % limit;
+}
+
+int failed = 0;
+
+void fail(const char* what, const std::string& description) {
+    printf("FAIL %s: %s\n", what, description.c_str());
+    failed += 1;
+}
+
+// Window bits for zlib's deflateInit2() and inflateInit2().
+int windowBits(AsyncHTTPRequest::CompressionFormat format, int bits) {
+    switch (format) {
+        case AsyncHTTPRequest::FORMAT_RAW:
+            return -bits;
+        case AsyncHTTPRequest::FORMAT_GZIP:
+            return bits + 16;
+        default:
+            return bits;
+    }
+}
+
+const char* name(AsyncHTTPRequest::CompressionFormat format) {
+    switch (format) {
+        case AsyncHTTPRequest::FORMAT_RAW:
+            return "raw";
+        case AsyncHTTPRequest::FORMAT_ZLIB:
+            return "zlib";
+        case AsyncHTTPRequest::FORMAT_GZIP:
+            return "gzip";
+        case AsyncHTTPRequest::FORMAT_DEFLATE:
+            return "deflate";
+    }
+    return "?";
+}
+
+std::string zlibCompress(const std::string& data, AsyncHTTPRequest::CompressionFormat format, int level, int bits, int strategy) {
+    z_stream stream = {};
+    if (deflateInit2(&stream, level, Z_DEFLATED, windowBits(format, bits), 9, strategy) != Z_OK) {
+        abort();
+    }
+    std::string output(deflateBound(&stream, data.size()) + 64, '\0');
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    stream.avail_in = data.size();
+    stream.next_out = reinterpret_cast<Bytef*>(&output[0]);
+    stream.avail_out = output.size();
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+        abort();
+    }
+    output.resize(stream.total_out);
+    deflateEnd(&stream);
+    return output;
+}
+
+// Returns false if zlib rejects the stream or it is incomplete.
+bool zlibInflate(const std::string& data, AsyncHTTPRequest::CompressionFormat format, std::string* output) {
+    z_stream stream = {};
+    if (inflateInit2(&stream, windowBits(format, 15)) != Z_OK) {
+        abort();
+    }
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    stream.avail_in = data.size();
+    int result;
+    do {
+        char buffer[4096];
+        stream.next_out = reinterpret_cast<Bytef*>(buffer);
+        stream.avail_out = sizeof(buffer);
+        result = inflate(&stream, Z_NO_FLUSH);
+        output->append(buffer, sizeof(buffer) - stream.avail_out);
+    } while (result == Z_OK && stream.avail_out == 0);
+    inflateEnd(&stream);
+    return result == Z_STREAM_END;
+}
+
+// Passes data to sink in pieces of random length, returns false if the sink fails.
+bool writeSplit(AsyncHTTPRequest::Sink* sink, const std::string& data) {
+    size_t offset = 0;
+    while (offset < data.size()) {
+        auto length = data.size() - offset;
+        switch (random(3)) {
+            case 0:
+                length = 1;
+                break;
+            case 1:
+                length = 1 + random(length < 64 ? length : 64);
+                break;
+            default:
+                break;
+        }
+        if (random(4) == 0) {
+            length = 1 + random(length);
+        }
+        if (!sink->write(data.data() + offset, length)) {
+            return false;
+        }
+        offset += length;
+    }
+    return sink->finish();
+}
+
+bool inflate(const std::string& data, AsyncHTTPRequest::CompressionFormat format, std::string* output) {
+    StringSink sink;
+    AsyncHTTPRequest::Inflater inflater(&sink, format);
+    auto ok = writeSplit(&inflater, data);
+    *output = sink.data;
+    return ok;
+}
+
+std::string deflate(const std::string& data, AsyncHTTPRequest::CompressionFormat format, size_t window_size) {
+    StringSink sink;
+    AsyncHTTPRequest::Deflater deflater(&sink, format, window_size);
+    if (!writeSplit(&deflater, data)) {
+        fail("deflate", "deflater failed");
+    }
+    return sink.data;
+}
+
+std::string describe(const std::string& what, AsyncHTTPRequest::CompressionFormat format, size_t size) {
+    return what + ", " + name(format) + ", " + std::to_string(size) + " bytes";
+}
+
+std::vector<std::string> samples(int iterations) {
+    std::vector<std::string> samples = {"", "a", "hello, world\n"};
+
+    // Real files: the library sources.
+    for (auto file : {"../../src/AsyncHTTPRequest.cpp", "../../src/AsyncHTTPRequest.h", "../../src/AsyncHTTPRequestCompression.cpp"}) {
+        std::ifstream stream(file, std::ios::binary);
+        samples.emplace_back(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+    }
+
+    for (int i = 0; i < iterations; i++) {
+        std::string sample;
+        size_t size = random(4) == 0 ? random(200000) : random(5000);
+        switch (i % 4) {
+            case 0:
+                // Incompressible.
+                while (sample.size() < size) {
+                    sample += static_cast<char>(random(256));
+                }
+                break;
+            case 1:
+                // Few symbols, long runs.
+                while (sample.size() < size) {
+                    sample.append(1 + random(300), static_cast<char>('a' + random(3)));
+                }
+                break;
+            default:
+                // Copies of earlier data at all distances, with some noise.
+                while (sample.size() < size) {
+                    if (sample.size() > 3 && random(3) > 0) {
+                        auto distance = 1 + random(sample.size() < 40000 ? sample.size() : 40000);
+                        auto length = 3 + random(300);
+                        for (size_t j = 0; j < length; j++) {
+                            sample += sample[sample.size() - distance];
+                        }
+                    }
+                    else {
+                        sample += static_cast<char>(random(random(2) ? 256 : 16));
+                    }
+                }
+                break;
+        }
+        samples.push_back(sample);
+    }
+    return samples;
+}
+
+void testZlibToInflater(const std::string& sample) {
+    const int strategies[] = {Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE, Z_FIXED};
+
+    for (auto format : {AsyncHTTPRequest::FORMAT_RAW, AsyncHTTPRequest::FORMAT_ZLIB, AsyncHTTPRequest::FORMAT_GZIP}) {
+        auto level = static_cast<int>(random(10));
+        auto bits = static_cast<int>(9 + random(7));
+        auto strategy = strategies[random(5)];
+        auto compressed = zlibCompress(sample, format, level, bits, strategy);
+        auto description = describe("level " + std::to_string(level) + ", window bits " + std::to_string(bits) + ", strategy " + std::to_string(strategy), format, sample.size());
+
+        std::string output;
+        if (!inflate(compressed, format, &output) || output != sample) {
+            fail("zlib to Inflater", description);
+        }
+        // Content-Encoding: deflate is zlib or raw.
+        if (format != AsyncHTTPRequest::FORMAT_GZIP && (!inflate(compressed, AsyncHTTPRequest::FORMAT_DEFLATE, &output) || output != sample)) {
+            fail("zlib to Inflater as deflate", description);
+        }
+
+        if (!compressed.empty()) {
+            std::string truncated_output;
+            if (inflate(compressed.substr(0, random(compressed.size())), format, &truncated_output)) {
+                fail("truncated stream accepted", description);
+            }
+
+            // Corrupt a few bytes.
+            auto corrupted = compressed;
+            for (auto n = 1 + random(3); n > 0; n--) {
+                corrupted[random(corrupted.size())] ^= static_cast<char>(1 + random(255));
+            }
+            std::string expected;
+            auto expected_ok = zlibInflate(corrupted, format, &expected);
+            auto ok = inflate(corrupted, format, &output);
+            if (ok != expected_ok || (ok && output != expected)) {
+                fail(expected_ok ? "corrupted stream rejected" : "corrupted stream accepted", description);
+            }
+        }
+    }
+}
+
+void testDeflaterToZlib(const std::string& sample) {
+    for (auto format : {AsyncHTTPRequest::FORMAT_RAW, AsyncHTTPRequest::FORMAT_ZLIB, AsyncHTTPRequest::FORMAT_GZIP, AsyncHTTPRequest::FORMAT_DEFLATE}) {
+        size_t window_size = 256 << random(8);
+        auto compressed = deflate(sample, format, window_size);
+        // FORMAT_DEFLATE produces zlib format.
+        auto zlib_format = format == AsyncHTTPRequest::FORMAT_DEFLATE ? AsyncHTTPRequest::FORMAT_ZLIB : format;
+        auto description = describe("window " + std::to_string(window_size), format, sample.size());
+
+        std::string output;
+        if (!zlibInflate(compressed, zlib_format, &output) || output != sample) {
+            fail("Deflater to zlib", description);
+        }
+        if (!inflate(compressed, format, &output) || output != sample) {
+            fail("Deflater to Inflater", description);
+        }
+    }
+}
+
+}
+
+
+int main(int argc, char** argv) {
+    auto iterations = argc > 1 ? atoi(argv[1]) : 200;
+    if (argc > 2) {
+        random_state = strtoul(argv[2], nullptr, 0) | 1;
+    }
+
+    auto all = samples(iterations);
+    for (auto& sample : all) {
+        testZlibToInflater(sample);
+        testDeflaterToZlib(sample);
+    }
+
+    printf("%zu samples, %d failures\n", all.size(), failed);
+    return failed > 0 ? 1 : 0;
+}
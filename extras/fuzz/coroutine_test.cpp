@@ -0,0 +1,155 @@
+// Coroutines awaiting requests on the host build. The harness plays the network task, so each coroutine is
+// resumed from inside the client callback that completes its request or brings its data.
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "AsyncHTTPRequest.h"
+
+#ifndef HTTP_COROUTINES
+#error "coroutine_test needs a compiler with coroutine support (-std=gnu++20)"
+#endif
+
+namespace {
+
+const char* response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nTransfer-Encoding: chunked\r\n\r\n"
+    "7\r\nhello, \r\n6\r\nworld!\r\n0\r\n\r\n";
+
+int failed = 0;
+
+void check(bool condition, const char* test, const char* what) {
+    if (!condition) {
+        printf("FAIL %s: %s\n", test, what);
+        failed += 1;
+    }
+}
+
+void receive(AsyncSSLClient* client, const char* data, size_t segment) {
+    auto length = strlen(data);
+    for (size_t offset = 0; offset < length && AsyncSSLClient::last == client; offset += segment) {
+        client->received(data + offset, segment < length - offset ? segment : length - offset);
+    }
+}
+
+struct Result {
+    bool resumed = false;
+    AsyncHTTPRequest::Error error = AsyncHTTPRequest::ERROR_OK;
+    std::string body;
+};
+
+AsyncHTTPRequest::Task get(AsyncHTTPRequest* request, Result* result, bool read_body = true) {
+    result->error = co_await request->getAsync("http://host.test/");
+    result->resumed = true;
+    if (!read_body) {
+        co_return;
+    }
+    char buffer[64];
+    size_t length;
+    while ((length = request->read(buffer, sizeof(buffer))) > 0) {
+        result->body.append(buffer, length);
+    }
+}
+
+AsyncHTTPRequest::Task read(AsyncHTTPRequest* request, Result* result) {
+    auto reader = request->responseReader();
+    char buffer[5];
+    size_t length;
+    while ((length = co_await reader->readAsync(buffer, sizeof(buffer))) > 0) {
+        result->body.append(buffer, length);
+    }
+    result->resumed = true;
+    result->error = request->error();
+}
+
+// Destroys the request once resumed, which it may.
+AsyncHTTPRequest::Task getAndDelete(AsyncHTTPRequest* request, Result* result) {
+    result->error = co_await request->getAsync("http://host.test/");
+    result->resumed = true;
+    delete request;
+}
+
+void testCompletion() {
+    for (size_t segment : {1, 3, 200}) {
+        auto request = new AsyncHTTPRequest();
+        Result result;
+        get(request, &result);
+        check(!result.resumed, "completion", "resumed before the response");
+        auto client = AsyncSSLClient::last;
+        client->connected();
+        receive(client, response, segment);
+        check(result.resumed, "completion", "not resumed");
+        check(result.error == AsyncHTTPRequest::ERROR_OK, "completion", "error");
+        check(result.body == "hello, world!", "completion", "body");
+        delete request;
+    }
+}
+
+void testReadAsync() {
+    for (size_t segment : {1, 4, 200}) {
+        auto request = new AsyncHTTPRequest();
+        request->setWakeup(1);
+        Result completion;
+        Result reading;
+        get(request, &completion, false);
+        read(request, &reading);
+        auto client = AsyncSSLClient::last;
+        client->connected();
+        receive(client, response, segment);
+        check(reading.resumed, "readAsync", "reader not done");
+        check(reading.body == "hello, world!", "readAsync", "body");
+        check(completion.resumed && completion.error == AsyncHTTPRequest::ERROR_OK, "readAsync", "completion");
+        delete request;
+    }
+}
+
+void testAbort() {
+    auto request = new AsyncHTTPRequest();
+    Result result;
+    getAndDelete(request, &result);
+    AsyncSSLClient::last->connected();
+    request->abort();
+    check(result.resumed, "abort", "not resumed");
+    check(result.error == AsyncHTTPRequest::ERROR_ABORTED, "abort", "error");
+
+    // The body read so far is discarded.
+    request = new AsyncHTTPRequest();
+    request->setWakeup(1);
+    Result completion;
+    Result reading;
+    get(request, &completion, false);
+    read(request, &reading);
+    auto client = AsyncSSLClient::last;
+    client->connected();
+    client->received(response, strlen(response) - 10);
+    request->abort();
+    check(reading.resumed && reading.error == AsyncHTTPRequest::ERROR_ABORTED, "abort", "reader not resumed");
+    check(completion.resumed && completion.error == AsyncHTTPRequest::ERROR_ABORTED, "abort", "completion");
+    delete request;
+}
+
+void testClosed() {
+    auto request = new AsyncHTTPRequest();
+    Result result;
+    get(request, &result);
+    auto client = AsyncSSLClient::last;
+    client->connected();
+    client->received(response, 40);
+    client->disconnected();
+    check(result.resumed, "closed", "not resumed");
+    check(result.error == AsyncHTTPRequest::ERROR_CONNECTION_CLOSED, "closed", "error");
+    delete request;
+}
+
+}
+
+
+int main() {
+    testCompletion();
+    testReadAsync();
+    testAbort();
+    testClosed();
+
+    printf("%d failures\n", failed);
+    return failed > 0 ? 1 : 0;
+}
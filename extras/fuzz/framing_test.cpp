@@ -0,0 +1,120 @@
+// Table of responses with how their message framing must be interpreted (RFC 9112 section 6).
+// Each one is received whole into a sink and read(), and must give the result in the table. Then it is received
+// byte by byte, split at every point and, if it is short, at every pair of points, which must give the same result.
+
+#include <cstdio>
+#include <cstring>
+
+#include "harness.h"
+
+namespace {
+
+struct Case {
+    const char* name;
+    const char* method;
+    const char* data;
+    bool close; // server closes the connection after data
+    AsyncHTTPRequest::Error error;
+    int status;
+    const char* body;
+    const char* content_type = "";
+    bool complete = true;
+};
+
+const Case cases[] = {
+    {"Content-Length", "GET", "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello", false, AsyncHTTPRequest::ERROR_OK, 200, "hello"},
+    {"Content-Length ends body", "GET", "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello, world", false, AsyncHTTPRequest::ERROR_OK, 200, "hello"},
+    {"Content-Length truncated", "GET", "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nhello", true, AsyncHTTPRequest::ERROR_CONNECTION_CLOSED, 200, "hello"},
+    {"Content-Length 0", "GET", "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n", false, AsyncHTTPRequest::ERROR_OK, 200, ""},
+    {"Content-Length 9 digits", "GET", "HTTP/1.1 200 OK\r\nContent-Length: 000000005\r\n\r\nhello", false, AsyncHTTPRequest::ERROR_OK, 200, "hello"},
+    {"Content-Length 10 digits", "GET", "HTTP/1.1 200 OK\r\nContent-Length: 1000000000\r\n\r\nhello", false, AsyncHTTPRequest::ERROR_PROTOCOL, 200, ""},
+    {"Content-Length not a number", "GET", "HTTP/1.1 200 OK\r\nContent-Length: 5x\r\n\r\nhello", false, AsyncHTTPRequest::ERROR_PROTOCOL, 200, ""},
+    {"Content-Length negative", "GET", "HTTP/1.1 200 OK\r\nContent-Length: -5\r\n\r\nhello", false, AsyncHTTPRequest::ERROR_PROTOCOL, 200, ""},
+    {"Content-Length repeated", "GET", "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nContent-Length: 5\r\n\r\nhello", false, AsyncHTTPRequest::ERROR_OK, 200, "hello"},
+    {"Content-Length conflicting", "GET", "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nContent-Length: 6\r\n\r\nhello!", false, AsyncHTTPRequest::ERROR_PROTOCOL, 200, ""},
+    {"OWS trimmed", "GET", "HTTP/1.1 200 OK\r\nContent-Length: \t 5 \t\r\nContent-Type:  text/plain \r\n\r\nhello", false, AsyncHTTPRequest::ERROR_OK, 200, "hello", "text/plain"},
+    {"whitespace before colon", "GET", "HTTP/1.1 200 OK\r\nContent-Length : 5\r\n\r\nhello", false, AsyncHTTPRequest::ERROR_PROTOCOL, 200, ""},
+    {"obsolete line folding", "GET", "HTTP/1.1 200 OK\r\nX-Folded: a\r\n b\r\nContent-Length: 5\r\n\r\nhello", false, AsyncHTTPRequest::ERROR_PROTOCOL, 200, ""},
+    {"bare LF", "GET", "HTTP/1.1 200 OK\nContent-Length: 5\n\nhello", false, AsyncHTTPRequest::ERROR_OK, 200, "hello"},
+    {"close delimited", "GET", "HTTP/1.1 200 OK\r\n\r\nhello, world", true, AsyncHTTPRequest::ERROR_OK, 200, "hello, world"},
+    {"close delimited running", "GET", "HTTP/1.1 200 OK\r\n\r\nhello", false, AsyncHTTPRequest::ERROR_OK, 200, "hello", "", false},
+    {"chunked", "GET", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n7;ext=1\r\n, world\r\n0\r\n\r\n", false, AsyncHTTPRequest::ERROR_OK, 200, "hello, world"},
+    {"chunked with trailer", "GET", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n0\r\nX-Trailer: 1\r\n\r\n", false, AsyncHTTPRequest::ERROR_OK, 200, "hello"},
+    {"chunked truncated", "GET", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhel", true, AsyncHTTPRequest::ERROR_CONNECTION_CLOSED, 200, "hel"},
+    {"chunked invalid size", "GET", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nx\r\nhello\r\n0\r\n\r\n", false, AsyncHTTPRequest::ERROR_PROTOCOL, 200, ""},
+    {"Transfer-Encoding overrides Content-Length", "GET", "HTTP/1.1 200 OK\r\nContent-Length: 3\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n0\r\n\r\n", false, AsyncHTTPRequest::ERROR_OK, 200, "hello"},
+    {"Transfer-Encoding not chunked", "GET", "HTTP/1.1 200 OK\r\nTransfer-Encoding: gzip\r\nContent-Length: 3\r\n\r\nhello", true, AsyncHTTPRequest::ERROR_OK, 200, "hello"},
+    {"Transfer-Encoding chunked not last", "GET", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked, gzip\r\n\r\n5\r\nhello", true, AsyncHTTPRequest::ERROR_OK, 200, "5\r\nhello"},
+    {"1xx skipped", "GET", "HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 103 Early Hints\r\nLink: </a>\r\n\r\nHTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello", false, AsyncHTTPRequest::ERROR_OK, 200, "hello"},
+    {"101", "GET", "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n\r\n", false, AsyncHTTPRequest::ERROR_PROTOCOL, 101, ""},
+    {"HEAD", "HEAD", "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\n", false, AsyncHTTPRequest::ERROR_OK, 200, ""},
+    {"HEAD chunked", "HEAD", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n", false, AsyncHTTPRequest::ERROR_OK, 200, ""},
+    {"204", "GET", "HTTP/1.1 204 No Content\r\nContent-Length: 5\r\n\r\n", false, AsyncHTTPRequest::ERROR_OK, 204, ""},
+    {"304", "GET", "HTTP/1.1 304 Not Modified\r\nContent-Length: 5\r\n\r\n", false, AsyncHTTPRequest::ERROR_OK, 304, ""},
+    {"HTTP/1.0", "GET", "HTTP/1.0 200 OK\r\n\r\nhello", true, AsyncHTTPRequest::ERROR_OK, 200, "hello"},
+    {"invalid status line", "GET", "HTTP/1.1 2000 OK\r\nContent-Length: 5\r\n\r\nhello", false, AsyncHTTPRequest::ERROR_PROTOCOL, 0, ""},
+    {"not HTTP", "GET", "SSH-2.0-OpenSSH\r\n", false, AsyncHTTPRequest::ERROR_PROTOCOL, 0, ""},
+    {"closed before headers", "GET", "HTTP/1.1 200 OK\r\nContent-Le", true, AsyncHTTPRequest::ERROR_CONNECTION_CLOSED, 200, ""},
+};
+
+// Inputs up to this long are also split at every pair of points.
+const size_t max_pair_split_length = 96;
+
+bool expected(const Case& test, const Response& response) {
+    return response.error == test.error && response.complete == test.complete && response.status == test.status && response.body == test.body && (test.error != AsyncHTTPRequest::ERROR_OK || response.content_type == test.content_type);
+}
+
+// Segmentations in the form exchange() takes: byte by byte, split at each point, and at each pair of points.
+std::vector<std::vector<size_t>> splits(size_t length) {
+    std::vector<std::vector<size_t>> segmentations = {{1}};
+    for (size_t first = 1; first < length; first++) {
+        segmentations.push_back({first, length});
+        if (length <= max_pair_split_length) {
+            for (size_t second = first + 1; second < length; second++) {
+                segmentations.push_back({first, second - first, length});
+            }
+        }
+    }
+    return segmentations;
+}
+
+std::string describe(const std::vector<size_t>& segments) {
+    std::string description;
+    for (auto length : segments) {
+        description += (description.empty() ? "" : ", ") + std::to_string(length);
+    }
+    return description;
+}
+
+}
+
+
+// The response received whole must match the table, and every split of it must match the whole one.
+int main() {
+    auto failed = 0;
+    size_t runs = 0;
+
+    for (auto& test : cases) {
+        auto segmentations = splits(strlen(test.data));
+        for (auto sink : {false, true}) {
+            auto whole = exchange(test.method, test.data, {}, test.close, sink);
+            runs += 1;
+            if (!expected(test, whole)) {
+                printf("FAIL %s (%s, whole): %s\n", test.name, sink ? "sink" : "read", whole.describe().c_str());
+                failed += 1;
+                continue;
+            }
+            for (auto& segments : segmentations) {
+                auto response = exchange(test.method, test.data, segments, test.close, sink);
+                runs += 1;
+                if (response != whole) {
+                    printf("FAIL %s (%s, segments %s): %s\n", test.name, sink ? "sink" : "read", describe(segments).c_str(), response.describe().c_str());
+                    failed += 1;
+                }
+            }
+        }
+    }
+
+    printf("%zu cases, %zu runs, %d failures\n", sizeof(cases) / sizeof(cases[0]), runs, failed);
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,45 @@
+// Fuzz target for the response parser. The first byte of the input selects the request, the second how the
+// response is segmented; the rest is the response:
+//     flags: bit 0 HEAD instead of GET, bit 1 server closes the connection at the end, bit 2 decode the body
+// The response is received whole and read, and segmented into a sink; both must give the same result. How much
+// of the body is passed on before an error depends on the segments, so then one body only has to be a prefix of
+// the other.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+
+#include "harness.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* input, size_t size) {
+    if (size < 2) {
+        return 0;
+    }
+    auto flags = input[0];
+    uint32_t random = input[1] * 2654435761u + 1;
+    std::string data(reinterpret_cast<const char*>(input + 2), size - 2);
+    auto method = (flags & 1) ? "HEAD" : "GET";
+    auto close = (flags & 2) != 0;
+    auto compressed = (flags & 4) != 0;
+
+    std::vector<size_t> segments;
+    for (size_t length = 0; length < data.size(); length += segments.back()) {
+        random ^= random << 13;
+        random ^= random >> 17;
+        random ^= random << 5;
+        segments.push_back(1 + random % (input[1] % 64 + 1));
+    }
+
+    auto whole = exchange(method, data, {}, close, false, compressed);
+    auto segmented = exchange(method, data, segments, close, true, compressed);
+    auto shorter = std::min(whole.body.size(), segmented.body.size());
+    if (whole.error != AsyncHTTPRequest::ERROR_OK && whole.error == segmented.error && whole.body.compare(0, shorter, segmented.body, 0, shorter) == 0) {
+        whole.body.resize(shorter);
+        segmented.body.resize(shorter);
+    }
+    if (whole != segmented) {
+        fprintf(stderr, "whole:     %s\nsegmented: %s\n", whole.describe().c_str(), segmented.describe().c_str());
+        abort();
+    }
+    return 0;
+}
@@ -0,0 +1,90 @@
+#include <algorithm>
+
+#include "harness.h"
+
+namespace {
+
+class StringSink: public AsyncHTTPRequest::Sink {
+public:
+    bool write(const char* data, size_t length) override { body.append(data, length); return true; }
+    bool finish() override { finished = true; return true; }
+
+    std::string body;
+    bool finished = false;
+};
+
+}
+
+
+bool Response::operator==(const Response& other) const {
+    return error == other.error && complete == other.complete && status == other.status && content_type == other.content_type && body == other.body;
+}
+
+
+std::string Response::describe() const {
+    return "error " + std::to_string(error) + (complete ? ", complete" : ", running") + ", status " + std::to_string(status) + ", type '" + content_type + "', body '" + body + "'";
+}
+
+
+Response exchange(const char* method, const std::string& data, const std::vector<size_t>& segments, bool close, bool sink, bool compressed) {
+    Response response;
+    StringSink string_sink;
+    auto request = new AsyncHTTPRequest();
+
+    if (sink) {
+        request->setSink(&string_sink);
+    }
+    if (compressed) {
+        request->acceptCompressed();
+    }
+    if (request->send(method, "http://host.test/", nullptr, nullptr) != AsyncHTTPRequest::ERROR_OK) {
+        response.error = request->error();
+        delete request;
+        return response;
+    }
+
+    auto client = AsyncSSLClient::last;
+    client->connected();
+
+    size_t offset = 0;
+    size_t index = 0;
+    // The request deletes the client when it is done.
+    while (offset < data.size() && AsyncSSLClient::last == client) {
+        auto length = data.size() - offset;
+        if (!segments.empty()) {
+            length = std::min(length, std::max<size_t>(segments[index], 1));
+            if (index + 1 < segments.size()) {
+                index += 1;
+            }
+        }
+        client->received(data.data() + offset, length);
+        offset += length;
+    }
+    if (close && AsyncSSLClient::last == client) {
+        client->disconnected();
+    }
+
+    response.error = request->error();
+    response.complete = request->isComplete();
+    response.status = request->status();
+    if (request->contentType() != nullptr) {
+        response.content_type = request->contentType();
+    }
+    if (sink) {
+        response.body = string_sink.body;
+        if (response.complete && response.error == AsyncHTTPRequest::ERROR_OK && !string_sink.finished) {
+            fprintf(stderr, "sink not finished\n");
+            abort();
+        }
+    }
+    else {
+        char buffer[97];
+        size_t length;
+        while ((length = request->read(buffer, sizeof(buffer))) > 0) {
+            response.body.append(buffer, length);
+        }
+    }
+
+    delete request;
+    return response;
+}
@@ -0,0 +1,29 @@
+#ifndef FUZZ_HARNESS_H
+#define FUZZ_HARNESS_H
+
+// Runs a request against a canned response on the host build, see Makefile.
+
+#include <string>
+#include <vector>
+
+#include "AsyncHTTPRequest.h"
+
+struct Response {
+    AsyncHTTPRequest::Error error = AsyncHTTPRequest::ERROR_OK;
+    bool complete = false;
+    int status = 0;
+    std::string content_type;
+    std::string body;
+
+    bool operator==(const Response& other) const;
+    bool operator!=(const Response& other) const { return !(*this == other); }
+    std::string describe() const;
+};
+
+// Sends a request with method, then passes data to it in segments of the given lengths, repeating the last one
+// (all at once if segments is empty). If close is true, the server closes the connection at the end.
+// With sink, the body is passed to a sink instead of being read. With compressed, gzip and deflate content
+// encodings are decoded.
+Response exchange(const char* method, const std::string& data, const std::vector<size_t>& segments, bool close, bool sink, bool compressed = false);
+
+#endif // FUZZ_HARNESS_H
@@ -0,0 +1,87 @@
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+// Just enough of the Arduino API to build the library on a host, see extras/fuzz/Makefile.
+
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <strings.h>
+
+#include "freertos/FreeRTOS.h"
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+
+class String {
+public:
+    String() = default;
+    String(const char* s): s(s != nullptr ? s : "") {}
+    explicit String(int value): s(std::to_string(value)) {}
+    explicit String(unsigned int value): s(std::to_string(value)) {}
+    explicit String(long value): s(std::to_string(value)) {}
+    explicit String(unsigned long value): s(std::to_string(value)) {}
+
+    const char* c_str() const { return s.c_str(); }
+    unsigned int length() const { return s.size(); }
+
+    String operator+(const String& other) const { String result(*this); result.s += other.s; return result; }
+    String& operator+=(char c) { s += c; return *this; }
+
+private:
+    std::string s;
+};
+
+class Print {
+public:
+    virtual ~Print() = default;
+
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* data, size_t length);
+    size_t write(const char* data, size_t length) { return write(reinterpret_cast<const uint8_t*>(data), length); }
+    size_t print(const char* s) { return write(s, strlen(s)); }
+    size_t print(const String& s) { return print(s.c_str()); }
+    size_t print(int value) { return print(std::to_string(value).c_str()); }
+    size_t print(unsigned int value) { return print(std::to_string(value).c_str()); }
+    size_t print(long value) { return print(std::to_string(value).c_str()); }
+    size_t print(unsigned long value) { return print(std::to_string(value).c_str()); }
+    size_t print(long long value) { return print(std::to_string(value).c_str()); }
+    size_t print(unsigned long long value) { return print(std::to_string(value).c_str()); }
+    size_t println(const char* s) { return print(s) + print("\n"); }
+    size_t println(const String& s) { return println(s.c_str()); }
+    size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+    virtual void flush() {}
+};
+
+class Stream: public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual size_t readBytes(char* data, size_t length);
+    size_t readBytes(uint8_t* data, size_t length) { return readBytes(reinterpret_cast<char*>(data), length); }
+    String readStringUntil(char terminator);
+    void setTimeout(unsigned long timeout) { _timeout = timeout; }
+
+protected:
+    unsigned long _timeout = 1000;
+};
+
+// Writes to stderr.
+class HardwareSerial: public Stream {
+public:
+    size_t write(uint8_t c) override { return fputc(c, stderr) == EOF ? 0 : 1; }
+    size_t write(const uint8_t* data, size_t length) override { return fwrite(data, 1, length, stderr); }
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+};
+
+extern HardwareSerial Serial;
+
+#endif // HOST_ARDUINO_H
@@ -0,0 +1 @@
+#include "AsyncTCP_SSL.hpp"
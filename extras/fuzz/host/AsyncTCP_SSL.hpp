@@ -0,0 +1,138 @@
+#ifndef HOST_ASYNCTCP_SSL_HPP
+#define HOST_ASYNCTCP_SSL_HPP
+
+// Connection that the harness drives: it calls the handlers like the network task would, and collects what
+// the request sends. Like lwIP, it has a send window that the peer's ACKs open, and a receive window that the
+// request's ACKs open, see network.h.
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_set>
+
+#include <Arduino.h>
+
+class AsyncSSLClient;
+
+typedef std::function<void(void* arg, AsyncSSLClient* client)> AcConnectHandler;
+typedef std::function<void(void* arg, AsyncSSLClient* client, size_t length, uint32_t time)> AcAckHandler;
+typedef std::function<void(void* arg, AsyncSSLClient* client, int8_t error)> AcErrorHandler;
+typedef std::function<void(void* arg, AsyncSSLClient* client, void* data, size_t length)> AcDataHandler;
+typedef std::function<void(void* arg, AsyncSSLClient* client, uint32_t time)> AcTimeoutHandler;
+
+class AsyncSSLClient {
+public:
+    // TCP_SND_BUF and TCP_WND of the ESP32 Arduino core.
+    static const size_t send_window = 5744;
+    static const size_t receive_window = 5744;
+
+    AsyncSSLClient(): serial(next_serial++) { last = this; live.insert(this); }
+    ~AsyncSSLClient() {
+        if (last == this) {
+            last = nullptr;
+        }
+        live.erase(this);
+        if (exists != nullptr) {
+            *exists = false;
+        }
+    }
+
+    bool connect(const char* host, uint16_t port, bool secure = false) { (void)host; (void)port; (void)secure; return true; }
+    // Like AsyncTCP, closing an open connection calls the disconnect handler right away.
+    void close(bool now = false) {
+        (void)now;
+        if (closed) {
+            return;
+        }
+        closed = true;
+        auto handler = disconnect_handler;
+        if (handler) {
+            handler(disconnect_arg, this);
+        }
+    }
+    size_t space() { return send_window - in_flight; }
+    size_t add(const char* data, size_t length, uint8_t flags = 0) {
+        (void)flags;
+        if (length > space()) {
+            length = space();
+        }
+        sent.append(data, length);
+        in_flight += length;
+        return length;
+    }
+    bool send() { return true; }
+    size_t ack(size_t length) {
+        unacknowledged -= length < unacknowledged ? length : unacknowledged;
+        return length;
+    }
+    void ackLater() { ack_later = true; }
+    const char* errorToString(int8_t error) { (void)error; return "host error"; }
+
+    void onConnect(AcConnectHandler handler, void* arg = nullptr) { connect_handler = handler; connect_arg = arg; }
+    void onDisconnect(AcConnectHandler handler, void* arg = nullptr) { disconnect_handler = handler; disconnect_arg = arg; }
+    void onAck(AcAckHandler handler, void* arg = nullptr) { ack_handler = handler; ack_arg = arg; }
+    void onError(AcErrorHandler handler, void* arg = nullptr) { error_handler = handler; error_arg = arg; }
+    void onData(AcDataHandler handler, void* arg = nullptr) { data_handler = handler; data_arg = arg; }
+    void onTimeout(AcTimeoutHandler handler, void* arg = nullptr) { timeout_handler = handler; timeout_arg = arg; }
+    void onPoll(AcConnectHandler handler, void* arg = nullptr) { poll_handler = handler; poll_arg = arg; }
+
+    // Called by the harness. The request may delete the client in any of them.
+    void connected() { if (connect_handler) { connect_handler(connect_arg, this); } }
+    void acked(size_t length) {
+        in_flight -= length < in_flight ? length : in_flight;
+        if (ack_handler) {
+            ack_handler(ack_arg, this, length, 0);
+        }
+    }
+    // Received data is acknowledged when the handler returns, unless it calls ackLater().
+    void received(const char* data, size_t length) {
+        bool still_exists = true;
+        exists = &still_exists;
+        ack_later = false;
+        unacknowledged += length;
+        if (data_handler) {
+            data_handler(data_arg, this, const_cast<char*>(data), length);
+        }
+        if (still_exists) {
+            exists = nullptr;
+            if (!ack_later) {
+                ack(length);
+            }
+        }
+    }
+    void disconnected() { if (disconnect_handler) { disconnect_handler(disconnect_arg, this); } }
+    void polled() { if (poll_handler) { poll_handler(poll_arg, this); } }
+
+    // Most recently created client that still exists.
+    static AsyncSSLClient* last;
+    // Clients that exist. The serial number tells apart a new client at the address of a deleted one.
+    static std::unordered_set<AsyncSSLClient*> live;
+    static uint64_t next_serial;
+
+    const uint64_t serial;
+    std::string sent;
+    bool closed = false;
+    size_t in_flight = 0; // sent, not acknowledged by the peer
+    size_t unacknowledged = 0; // received, not acknowledged by the request
+
+private:
+    bool ack_later = false;
+    bool* exists = nullptr;
+
+    AcConnectHandler connect_handler;
+    void* connect_arg = nullptr;
+    AcConnectHandler disconnect_handler;
+    void* disconnect_arg = nullptr;
+    AcAckHandler ack_handler;
+    void* ack_arg = nullptr;
+    AcErrorHandler error_handler;
+    void* error_arg = nullptr;
+    AcDataHandler data_handler;
+    void* data_arg = nullptr;
+    AcTimeoutHandler timeout_handler;
+    void* timeout_arg = nullptr;
+    AcConnectHandler poll_handler;
+    void* poll_arg = nullptr;
+};
+
+#endif // HOST_ASYNCTCP_SSL_HPP
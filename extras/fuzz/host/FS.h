@@ -0,0 +1,37 @@
+#ifndef HOST_FS_H
+#define HOST_FS_H
+
+// Filesystem without files, the cache only keeps responses in memory.
+
+#include <Arduino.h>
+
+namespace fs {
+
+class File: public Stream {
+public:
+    size_t write(uint8_t c) override { (void)c; return 0; }
+    size_t write(const uint8_t* data, size_t length) override { (void)data; (void)length; return 0; }
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+    size_t read(uint8_t* data, size_t length) { (void)data; (void)length; return 0; }
+    size_t size() const { return 0; }
+    void close() {}
+    bool isDirectory() { return false; }
+    File openNextFile() { return File(); }
+    const char* name() const { return ""; }
+
+    explicit operator bool() const { return false; }
+};
+
+class FS {
+public:
+    File open(const char* path, const char* mode = "r") { (void)path; (void)mode; return File(); }
+    bool mkdir(const char* path) { (void)path; return false; }
+    bool remove(const char* path) { (void)path; return false; }
+    bool rename(const char* from, const char* to) { (void)from; (void)to; return false; }
+};
+
+}
+
+#endif // HOST_FS_H
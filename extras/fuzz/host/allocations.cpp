@@ -0,0 +1,40 @@
+// Replaces the global operator new to count allocations, see allocations.h.
+
+#include <cstdlib>
+#include <new>
+
+#include "allocations.h"
+
+size_t host_allocations = 0;
+bool host_count_allocations = false;
+
+void* operator new(size_t size) {
+    if (host_count_allocations) {
+        host_allocations += 1;
+    }
+    auto pointer = malloc(size > 0 ? size : 1);
+    if (pointer == nullptr) {
+        throw std::bad_alloc();
+    }
+    return pointer;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    if (host_count_allocations) {
+        host_allocations += 1;
+    }
+    return malloc(size > 0 ? size : 1);
+}
+
+void operator delete(void* pointer) noexcept {
+    free(pointer);
+}
+
+void operator delete(void* pointer, size_t size) noexcept {
+    (void)size;
+    free(pointer);
+}
+
+void operator delete(void* pointer, const std::nothrow_t&) noexcept {
+    free(pointer);
+}
@@ -0,0 +1,22 @@
+#ifndef HOST_ALLOCATIONS_H
+#define HOST_ALLOCATIONS_H
+
+// Counts calls of operator new while counting is on. Only programs that link allocations.cpp count, the others
+// always see 0.
+
+#include <cstddef>
+
+extern size_t host_allocations;
+extern bool host_count_allocations;
+
+// Counts the allocations made during its lifetime.
+class CountAllocations {
+public:
+    CountAllocations(): previous(host_count_allocations) { host_count_allocations = true; }
+    ~CountAllocations() { host_count_allocations = previous; }
+
+private:
+    bool previous;
+};
+
+#endif // HOST_ALLOCATIONS_H
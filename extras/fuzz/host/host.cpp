@@ -0,0 +1,188 @@
+// Implementation of the host stubs.
+
+#include <cstdarg>
+#include <mutex>
+
+#include <Arduino.h>
+#include <AsyncTCP_SSL.h>
+#include <esp_partition.h>
+#include <freertos/timers.h>
+
+HardwareSerial Serial;
+AsyncSSLClient* AsyncSSLClient::last = nullptr;
+std::unordered_set<AsyncSSLClient*> AsyncSSLClient::live;
+uint64_t AsyncSSLClient::next_serial = 1;
+
+// Time only passes when the harness says so.
+unsigned long host_micros = 0;
+
+unsigned long millis() {
+    return host_micros / 1000;
+}
+
+unsigned long micros() {
+    return host_micros;
+}
+
+void delay(unsigned long ms) {
+    host_micros += ms * 1000;
+}
+
+
+size_t Print::write(const uint8_t* data, size_t length) {
+    size_t n = 0;
+    while (n < length && write(data[n]) == 1) {
+        n += 1;
+    }
+    return n;
+}
+
+size_t Print::printf(const char* format, ...) {
+    char buffer[256];
+    va_list ap;
+    va_start(ap, format);
+    auto length = vsnprintf(buffer, sizeof(buffer), format, ap);
+    va_end(ap);
+    if (length < 0) {
+        return 0;
+    }
+    return write(buffer, static_cast<size_t>(length) < sizeof(buffer) ? length : sizeof(buffer) - 1);
+}
+
+size_t Stream::readBytes(char* data, size_t length) {
+    size_t n = 0;
+    int c;
+    while (n < length && (c = read()) >= 0) {
+        data[n++] = c;
+    }
+    return n;
+}
+
+String Stream::readStringUntil(char terminator) {
+    String s;
+    int c;
+    while ((c = read()) >= 0 && c != terminator) {
+        s += static_cast<char>(c);
+    }
+    return s;
+}
+
+
+esp_err_t esp_partition_erase_range(const esp_partition_t* partition, size_t offset, size_t size) {
+    return offset + size <= partition->size ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t* partition, size_t offset, const void* data, size_t size) {
+    (void)data;
+    return offset + size <= partition->size ? ESP_OK : ESP_FAIL;
+}
+
+
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+    return new std::mutex();
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t mutex) {
+    delete static_cast<std::mutex*>(mutex);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t mutex, TickType_t timeout) {
+    if (!static_cast<std::mutex*>(mutex)->try_lock()) {
+        if (timeout == portMAX_DELAY) {
+            fprintf(stderr, "deadlock: mutex %p is already taken\n", mutex);
+            abort();
+        }
+        return pdFALSE;
+    }
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t mutex) {
+    static_cast<std::mutex*>(mutex)->unlock();
+    return pdTRUE;
+}
+
+
+static int main_task;
+static int timer_task;
+
+BaseType_t xTaskCreate(void (*function)(void*), const char* name, uint32_t stack_size, void* arg, UBaseType_t priority, TaskHandle_t* task) {
+    (void)function; (void)name; (void)stack_size; (void)arg; (void)priority; (void)task;
+    return pdFAIL;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    (void)task;
+}
+
+void vTaskDelay(TickType_t ticks) {
+    delay(ticks);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+    return &main_task;
+}
+
+void xTaskNotifyGive(TaskHandle_t task) {
+    (void)task;
+}
+
+// Nobody else could give a notification.
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t timeout) {
+    (void)clear;
+    if (timeout == portMAX_DELAY) {
+        fprintf(stderr, "deadlock: waiting for a notification forever\n");
+        abort();
+    }
+    delay(timeout);
+    return 0;
+}
+
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+    (void)length; (void)item_size;
+    return nullptr;
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+    (void)queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t timeout) {
+    (void)queue; (void)item; (void)timeout;
+    return pdFAIL;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t timeout) {
+    (void)queue; (void)item; (void)timeout;
+    return pdFAIL;
+}
+
+
+// Timers never fire.
+struct Timer {
+    void* id;
+};
+
+TimerHandle_t xTimerCreate(const char* name, TickType_t period, UBaseType_t auto_reload, void* id, TimerCallbackFunction_t callback) {
+    (void)name; (void)period; (void)auto_reload; (void)callback;
+    return new Timer{id};
+}
+
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t timeout) {
+    (void)timer; (void)timeout;
+    return pdPASS;
+}
+
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t timeout) {
+    (void)timer; (void)timeout;
+    return pdPASS;
+}
+
+void* pvTimerGetTimerID(TimerHandle_t timer) {
+    return static_cast<Timer*>(timer)->id;
+}
+
+TaskHandle_t xTimerGetTimerDaemonTaskHandle() {
+    return &timer_task;
+}
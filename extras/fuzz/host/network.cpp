@@ -0,0 +1,154 @@
+// Implementation of the simulated network, see network.h.
+
+#include "network.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "allocations.h"
+
+extern unsigned long host_micros;
+
+const Network::Profile Network::profiles[] = {
+    {"lan", 1, 0, 1460, 1460, 0, 0},
+    {"wan", 50, 1000000, 1460, 1460, 0, 0},
+    {"lossy", 100, 250000, 1, 1460, 0.002, 0},
+    {"slow-upload", 1, 0, 1460, 1460, 0, 20000}
+};
+const size_t Network::profile_count = sizeof(profiles) / sizeof(profiles[0]);
+
+
+void Network::step() {
+    host_micros += 1000;
+    auto now = millis();
+    if (profile.rate > 0) {
+        rate_credit = std::min(rate_credit + static_cast<long>(profile.rate / 1000), static_cast<long>(profile.rate / 1000));
+    }
+
+    // The handshake takes a round trip.
+    for (auto client : AsyncSSLClient::live) {
+        if (client->serial >= next_serial) {
+            auto connection = std::unique_ptr<Connection>(new Connection());
+            connection->client = client;
+            connection->serial = client->serial;
+            connection->session.reset(accept());
+            connection->connect_at = now + 2 * profile.latency;
+            open.push_back(std::move(connection));
+        }
+    }
+    for (auto client : AsyncSSLClient::live) {
+        if (client->serial >= next_serial) {
+            next_serial = client->serial + 1;
+        }
+    }
+
+    // Handlers may create clients, which are connected in the next step.
+    for (size_t i = 0; i < open.size(); i++) {
+        if (!run(open[i].get(), now)) {
+            open.erase(open.begin() + i);
+            i -= 1;
+        }
+    }
+}
+
+
+// Returns false if the connection is gone.
+bool Network::run(Connection* connection, unsigned long now) {
+    auto client = connection->client;
+
+    if (!connection->exists() || client->closed) {
+        return false;
+    }
+    if (!connection->connected) {
+        if (now < connection->connect_at) {
+            return true;
+        }
+        connection->connected = true;
+        CountAllocations counting;
+        client->connected();
+        if (!connection->exists()) {
+            return false;
+        }
+    }
+
+    if (!client->sent.empty()) {
+        connection->to_server.push_back({now + profile.latency, client->sent, 0});
+        client->sent.clear();
+    }
+    // The server acknowledges what it read.
+    auto read_budget = profile.slow_read > 0 ? profile.slow_read / 1000 : std::numeric_limits<size_t>::max();
+    while (read_budget > 0 && !connection->to_server.empty() && connection->to_server.front().arrival <= now) {
+        auto& packet = connection->to_server.front();
+        auto length = std::min(packet.data.size() - connection->to_server_read, read_budget);
+        connection->session->receive(packet.data.data() + connection->to_server_read, length, &connection->output);
+        connection->acks.push_back({now + profile.latency, std::string(), length});
+        read_budget -= length;
+        connection->to_server_read += length;
+        if (connection->to_server_read == packet.data.size()) {
+            connection->to_server.pop_front();
+            connection->to_server_read = 0;
+        }
+    }
+    while (!connection->acks.empty() && connection->acks.front().arrival <= now) {
+        auto length = connection->acks.front().acknowledged;
+        connection->acks.pop_front();
+        CountAllocations counting;
+        client->acked(length);
+        if (!connection->exists()) {
+            return false;
+        }
+    }
+
+    while (!connection->to_client.empty() && connection->to_client.front().arrival <= now) {
+        auto packet = std::move(connection->to_client.front());
+        connection->to_client.pop_front();
+        connection->in_transit -= packet.data.size();
+        CountAllocations counting;
+        if (profile.disconnect > 0 && random() < profile.disconnect * 0x100000000) {
+            disconnects += 1;
+            client->disconnected();
+            return false;
+        }
+        client->received(packet.data.data(), packet.data.size());
+        if (!connection->exists()) {
+            return false;
+        }
+    }
+    auto& output = connection->output;
+    // Segments are sent whole, like by the server, which sleeps after each one. They wait for room in the window.
+    while (connection->output_sent < output.size() && (profile.rate == 0 || rate_credit > 0)) {
+        if (connection->segment_size == 0) {
+            connection->segment_size = profile.segment_min + random() % (profile.segment_max - profile.segment_min + 1);
+        }
+        auto length = std::min(output.size() - connection->output_sent, connection->segment_size);
+        if (connection->in_transit + client->unacknowledged + length > AsyncSSLClient::receive_window) {
+            break;
+        }
+        connection->segment_size = 0;
+        connection->to_client.push_back({now + profile.latency, output.substr(connection->output_sent, length), 0});
+        connection->output_sent += length;
+        connection->in_transit += length;
+        rate_credit -= length;
+    }
+    if (connection->output_sent == output.size()) {
+        output.clear();
+        connection->output_sent = 0;
+    }
+
+    if (now % 500 == 0) {
+        CountAllocations counting;
+        client->polled();
+        if (!connection->exists()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+uint32_t Network::random() {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
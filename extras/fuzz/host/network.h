@@ -0,0 +1,88 @@
+#ifndef HOST_NETWORK_H
+#define HOST_NETWORK_H
+
+// Connects the clients the library creates to in-process servers over a simulated network, in virtual time.
+// Each step advances host_micros by 1 ms. Only as much data is under way as the client's receive window allows,
+// so delayed ACKs stall the server. A profile adds the faults of extras/benchmark_server.py.
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <AsyncTCP_SSL.h>
+
+class Network {
+public:
+    struct Profile {
+        const char* name;
+        unsigned long latency; // ms each way, at least 1
+        size_t rate; // bytes/s to the client over all connections, 0 for no cap
+        size_t segment_min; // bytes per segment to the client
+        size_t segment_max;
+        double disconnect; // probability of dropping the connection per segment to the client
+        size_t slow_read; // bytes/s the server reads of what the client sends, 0 for no limit
+    };
+
+    // The profiles of extras/benchmark_server.py. There, latency delays each response, here each segment.
+    static const Profile profiles[];
+    static const size_t profile_count;
+
+    // Server side of a connection.
+    class Session {
+    public:
+        virtual ~Session() = default;
+
+        // Handles data the client sent, appends the response to output.
+        virtual void receive(const char* data, size_t length, std::string* output) = 0;
+    };
+
+    typedef std::function<Session*()> Accept;
+
+    Network(Accept accept, const Profile& profile, uint32_t seed = 1): accept(accept), profile(profile), random_state(seed | 1) {}
+
+    // Advances the time by 1 ms: connects new clients, passes data and ACKs on, and polls every 500 ms.
+    void step();
+    size_t connections() const { return open.size(); }
+
+    size_t disconnects = 0;
+
+private:
+    struct Packet {
+        unsigned long arrival;
+        std::string data;
+        size_t acknowledged;
+    };
+
+    struct Connection {
+        AsyncSSLClient* client;
+        uint64_t serial;
+        std::unique_ptr<Session> session;
+        unsigned long connect_at;
+        bool connected = false;
+        std::deque<Packet> to_server;
+        size_t to_server_read = 0; // of the first packet
+        std::deque<Packet> acks;
+        std::string output;
+        size_t output_sent = 0;
+        size_t segment_size = 0; // of the next segment, 0 if not drawn yet
+        std::deque<Packet> to_client;
+        size_t in_transit = 0;
+
+        bool exists() const { return AsyncSSLClient::live.count(client) > 0 && client->serial == serial; }
+    };
+
+    bool run(Connection* connection, unsigned long now);
+    uint32_t random();
+
+    Accept accept;
+    const Profile& profile;
+    uint32_t random_state;
+    uint64_t next_serial = 0;
+    long rate_credit = 0; // bytes, negative after a segment larger than the rest of the budget
+    std::vector<std::unique_ptr<Connection>> open;
+};
+
+#endif // HOST_NETWORK_H
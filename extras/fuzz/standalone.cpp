@@ -0,0 +1,32 @@
+// Runs the fuzz target on the files given as arguments, or on standard input if there are none (for AFL).
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* input, size_t size);
+
+static void run(std::istream& stream) {
+    std::string data((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+    LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+}
+
+int main(int argc, char** argv) {
+    if (argc == 1) {
+        run(std::cin);
+        return 0;
+    }
+    for (auto i = 1; i < argc; i++) {
+        std::ifstream file(argv[i], std::ios::binary);
+        if (!file) {
+            fprintf(stderr, "can't open %s\n", argv[i]);
+            return 1;
+        }
+        run(file);
+    }
+    printf("%d inputs\n", argc - 1);
+    return 0;
+}
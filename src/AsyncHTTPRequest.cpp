@@ -36,10 +36,13 @@
 //#define DEBUG_HTTP_MUTEX
 
 #ifdef DEBUG_HTTP
-#define DEBUG(x) Serial.println(String("HTTP: ") + x)
+#define TRACE_FOR(request, event, arg1, arg2) Trace::record(request, Trace::event, arg1, arg2, &Serial)
+#elif defined(HTTP_TRACE)
+#define TRACE_FOR(request, event, arg1, arg2) Trace::record(request, Trace::event, arg1, arg2)
 #else
-#define DEBUG(x) ((void)0)
+#define TRACE_FOR(request, event, arg1, arg2) ((void)0)
 #endif
+#define TRACE(event, arg1, arg2) TRACE_FOR(trace_id, event, arg1, arg2)
 #if defined(DEBUG_HTTP) && defined(DEBUG_HTTP_MUTEX)
 #define DEBUG_MUTEX(x) Serial.println(String("HTTP: ") + x)
 #else
@@ -48,31 +51,73 @@
 
 
 #define HTTP_MAX_LINE_LENGTH 512
-#define HTTP_READ_AHEAD HTTP_BUFFER_FRAGMENT_SIZE
+
+AsyncHTTPRequest::TimerWheel AsyncHTTPRequest::timer_wheel;
 
 AsyncHTTPRequest::~AsyncHTTPRequest() {
-    close_client();
+    cancelDeadline(true);
+    if (mutex) {
+        auto lock = Lock(mutex);
+        auto old_client = detach_client();
+        lock.unlock();
+        close_client(old_client);
+    }
+    if (cache_recording_file) {
+        cache->abortFile(cache_key, cache_recording_file);
+    }
     if (mutex) {
         vSemaphoreDelete(mutex);
     }
     delete requestBody;
     delete responseBody;
+    delete inflater;
+    delete deflater;
     delete response_reader;
+    // The buffers release their fragments when they are destroyed.
+    memory_usage.released(object_memory + sizeof(*this));
+}
+
+void AsyncHTTPRequest::setWakeup(size_t low_water, size_t high_water, uint32_t max_delay_ms) {
+    if (high_water == 0) {
+        high_water = 1;
+    }
+    if (low_water == 0) {
+        low_water = 1;
+    }
+    else if (low_water > high_water) {
+        low_water = high_water;
+    }
+    wakeup_low_water = low_water;
+    wakeup_high_water = high_water;
+    wakeup_max_delay = max_delay_ms;
 }
 
+
 void AsyncHTTPRequest::abort() {
+    if (mutex == nullptr) {
+        return;
+    }
     auto lock = Lock(mutex);
 
-    // TODO: implement
+    if (isComplete()) {
+        return;
+    }
+
+    // The connection is closed when the error is posted.
+    handleError(ERROR_ABORTED);
+    freeBuffers();
+
+    lock.unlock();
+    post_notifications();
 }
 
 
 size_t AsyncHTTPRequest::contentLength() const {
-    if (haveContentLength){
+    if (haveContentLength && inflater == nullptr){
         return responseContentLength;
     }
     else if (state == COMPLETE) {
-        return dataReceived;
+        return bodyReceived;
     }
     else {
         return 0;
@@ -80,27 +125,40 @@ size_t AsyncHTTPRequest::contentLength() const {
 }
 
 
+// The body is only read by one task, so only ACKs need the lock.
 size_t AsyncHTTPRequest::read(char* data, size_t length) {
-    auto lock = Lock(mutex);
-
-    return read_prelocked(data, length);
-}
-
-
-size_t AsyncHTTPRequest::read_prelocked(char* data, size_t length) {
     size_t bytes_read = 0;
 
+    if (!acquireBody()) {
+        return 0;
+    }
+
     if (responseBody) {
         bytes_read = responseBody->read(data, length);
 
-        if (unacknowledged_length > 0 && client != nullptr && responseBody->available() < HTTP_READ_AHEAD) {
-            DEBUG("Buffer drained, ACK " + unacknowledged_length + " bytes.");
-            client->ack(unacknowledged_length);
-            unacknowledged_length = 0;
+        if (delayed_ack && responseBody->available() < wakeup_high_water) {
+            auto lock = Lock(mutex);
+            acknowledgeDelayed();
         }
     }
+    releaseBody();
 
-    //DEBUG("Reading " + length + " bytes, returning " + bytes_read);
+    // The cached response is set before the request completes and not changed afterwards.
+    if (bytes_read < length && state == COMPLETE && cached_response) {
+        if (cached_response_file) {
+            bytes_read += cached_response_file.read(reinterpret_cast<uint8_t*>(data + bytes_read), length - bytes_read);
+        }
+        else {
+            auto& body = cached_response->body;
+            auto n = length - bytes_read;
+            if (n > body.size() - cached_response_offset) {
+                n = body.size() - cached_response_offset;
+            }
+            memcpy(data + bytes_read, body.data() + cached_response_offset, n);
+            cached_response_offset += n;
+            bytes_read += n;
+        }
+    }
 
     return bytes_read;
 }
@@ -114,13 +172,10 @@ AsyncHTTPRequest::Error AsyncHTTPRequest::send(const char* method, const char* u
 
     auto url = URL(url_string);
 
-    auto use_ssl = false;
-
     if (url.scheme == "http") {
     }
 #ifdef USE_SSL
     else if (url.scheme == "https") {
-        use_ssl = true;
     }
 #endif
     else {
@@ -128,83 +183,205 @@ AsyncHTTPRequest::Error AsyncHTTPRequest::send(const char* method, const char* u
         return error();
     }
 
+    if (cache != nullptr && strcmp(method, "GET") == 0) {
+        cache_key = url_string;
+        cache_candidate = cache->lookup(cache_key);
+    }
+
     mutex = xSemaphoreCreateMutex();
     if (mutex == nullptr) {
         handleError(ERROR_CANNOT_CONNECT, "can't create mutex");
         return error();
     }
+    if (sink == nullptr) {
+        responseBody = new Queue(&memory_usage);
+    }
+
+    mark(timings.started);
+    metrics.count(Metrics::REQUESTS_STARTED);
+    request_method = method;
+    request_url = url_string;
+    requestBody = body;
+    request_started = millis();
+
+    if (!connect(content_type)) {
+        handleError(ERROR_CANNOT_CONNECT);
+        buffer.clear();
+        requestBody = nullptr;
+        return error();
+    }
+
+    return ERROR_OK;
+}
 
-    client = new AsyncSSLClient();
-    client->onAck([this](void *arg, AsyncSSLClient *client, size_t len, uint32_t time) {
-                this->handleAck(len, time);
-    });
-    client->onConnect([this](void *arg, AsyncSSLClient *client) {
-        this->handleConnect();
-    });
-    client->onData([this](void *arg, AsyncSSLClient *client, void *data, size_t length) {
-        this->handleData((char *) data, length);
-    });
-    client->onDisconnect([this](void *arg, AsyncSSLClient *client) {
-        this->handleDisconnect();
-    });
-    client->onError([this](void *arg, AsyncSSLClient *client, int error) {
-        this->handleError(error);
-    });
-    client->onTimeout([this](void *arg, AsyncSSLClient *client, int timeout) {
-        this->handleTimeout(timeout);
-    });
 
-    buffer.print(method);
+bool AsyncHTTPRequest::connect(const char* content_type) {
+    auto url = URL(request_url.c_str());
+    auto use_ssl = url.scheme == "https";
+
+    connect_started = last_activity = millis();
+    client = new AsyncSSLClient();
+    client->onAck(clientAck, this);
+    client->onConnect(clientConnect, this);
+    client->onData(clientData, this);
+    client->onDisconnect(clientDisconnect, this);
+    client->onError(clientError, this);
+    client->onTimeout(clientTimeout, this);
+    client->onPoll(clientPoll, this);
+
+    buffer.clear();
+    buffer.print(request_method.c_str());
     buffer.print (" ");
     buffer.print(url.path.c_str());
     buffer.print(" HTTP/1.1\r\nHost: ");
     buffer.print(url.host.c_str());
     buffer.print("\r\n");
-    if (body != nullptr) {
+    if (requestBody != nullptr) {
         if (content_type != nullptr) {
             buffer.print("Content-Type: ");
             buffer.print(content_type);
             buffer.print("\r\n");
         }
-        buffer.print("Content-Length: ");
-        buffer.print(String(body->available()));
+        if (compress_body) {
+            buffer.print(body_compression == FORMAT_GZIP ? "Content-Encoding: gzip\r\n" : "Content-Encoding: deflate\r\n");
+            buffer.print("Transfer-Encoding: chunked\r\n");
+            delete deflater;
+            deflater = new Deflater(&chunkedBody, body_compression);
+        }
+        else {
+            buffer.print("Content-Length: ");
+            buffer.print(String(requestBody->available()));
+            buffer.print("\r\n");
+        }
+    }
+    if (cache_candidate) {
+        if (!cache_candidate->etag.empty()) {
+            buffer.print("If-None-Match: ");
+            buffer.print(cache_candidate->etag.c_str());
+            buffer.print("\r\n");
+        }
+        if (!cache_candidate->last_modified.empty()) {
+            buffer.print("If-Modified-Since: ");
+            buffer.print(cache_candidate->last_modified.c_str());
+            buffer.print("\r\n");
+        }
+    }
+    if (inflate_window_size > 0) {
+        buffer.print("Accept-Encoding: gzip, deflate\r\n");
+    }
+    if (haveRange || resume_offset > 0) {
+        buffer.print("Range: bytes=");
+        buffer.print(String(rangeFirst + resume_offset));
+        buffer.print("-");
+        if (haveRange) {
+            buffer.print(String(rangeLast));
+        }
         buffer.print("\r\n");
+        if (!resume_validator.empty()) {
+            buffer.print("If-Range: ");
+            buffer.print(resume_validator.c_str());
+            buffer.print("\r\n");
+        }
     }
     buffer.print("\r\n");
 
-    DEBUG("Request size: " + buffer.available());
-
-    requestBody = body;
-
     state = CONNECTING;
-    DEBUG("Connecting");
+    TRACE(CONNECTING, buffer.available(), url.port);
+    // The connect and header deadlines start again, possibly earlier than the armed one.
+    armDeadline();
     if (!client->connect(url.host.c_str(), url.port
 #ifdef USE_SSL
                          , use_ssl
 #endif
                          )) {
-        handleError(ERROR_CANNOT_CONNECT);
-        buffer.clear();
-        requestBody = nullptr;
         delete client;
         client = nullptr;
-        return error();
+        account_objects();
+        return false;
     }
+    account_objects();
 
-    return ERROR_OK;
+    return true;
+}
+
+
+bool AsyncHTTPRequest::resumeDownload() {
+    if (state < SENDING_REQUEST || state > RECEIVING_BODY || resume_attempts >= max_resume_attempts || dataReceived == 0 || !rangesSupported || resume_validator.empty() || requestBody != nullptr) {
+        return false;
+    }
+    if (haveContentLength && dataReceived >= responseContentLength) {
+        return false;
+    }
+
+    TRACE(RESUMING, dataReceived, resume_attempts);
+    metrics.count(Metrics::RESUMES);
+    resume_attempts += 1;
+    if (resume_offset == 0) {
+        resume_status = httpStatus;
+    }
+    resume_offset = dataReceived;
+    httpStatus = 0;
+    chunkedResponse = false;
+    haveContentLength = false;
+    haveTransferEncoding = false;
+    chunkSize = 0;
+    chunkState = CHUNK_SIZE_START;
+    contentRangeStart = 0;
+    unacknowledged_length = 0;
+
+    return connect(nullptr);
+}
+
+
+void AsyncHTTPRequest::clientAck(void* arg, AsyncSSLClient* client, size_t length, uint32_t time) {
+    static_cast<AsyncHTTPRequest*>(arg)->handleAck(length, time);
+}
+
+
+void AsyncHTTPRequest::clientConnect(void* arg, AsyncSSLClient* client) {
+    static_cast<AsyncHTTPRequest*>(arg)->handleConnect();
+}
+
+
+void AsyncHTTPRequest::clientData(void* arg, AsyncSSLClient* client, void* data, size_t length) {
+    static_cast<AsyncHTTPRequest*>(arg)->handleData(static_cast<char*>(data), length);
+}
+
+
+void AsyncHTTPRequest::clientDisconnect(void* arg, AsyncSSLClient* client) {
+    static_cast<AsyncHTTPRequest*>(arg)->handleDisconnect();
+}
+
+
+void AsyncHTTPRequest::clientError(void* arg, AsyncSSLClient* client, int8_t error) {
+    static_cast<AsyncHTTPRequest*>(arg)->handleError(error);
+}
+
+
+void AsyncHTTPRequest::clientTimeout(void* arg, AsyncSSLClient* client, uint32_t time) {
+    static_cast<AsyncHTTPRequest*>(arg)->handleTimeout(time);
+}
+
+
+void AsyncHTTPRequest::clientPoll(void* arg, AsyncSSLClient* client) {
+    static_cast<AsyncHTTPRequest*>(arg)->handlePoll();
 }
 
 
 void AsyncHTTPRequest::handleAck(size_t len, uint32_t time) {
-    DEBUG("Got TCP ACK.");
+    TRACE(TCP_ACK, len, time);
     auto lock = Lock(mutex);
 
-    if (state == CONNECTING) {
-        state = SENDING_REQUEST;
-    }
     (void)len;
     (void)time;
-    sendData();
+    // Otherwise the request failed while the event was queued.
+    if (state == CONNECTING || state == SENDING_REQUEST || state == SENDING_BODY) {
+        last_activity = millis();
+        if (state == CONNECTING) {
+            state = SENDING_REQUEST;
+        }
+        sendData();
+    }
 
     lock.unlock();
     post_notifications();
@@ -212,11 +389,17 @@ void AsyncHTTPRequest::handleAck(size_t len, uint32_t time) {
 
 
 void AsyncHTTPRequest::handleConnect() {
-    DEBUG("Got TCP Connected.");
+    TRACE(TCP_CONNECTED, 0, 0);
     auto lock = Lock(mutex);
 
-    state = SENDING_REQUEST;
-    sendData();
+    // Otherwise the request was aborted or timed out while connecting; its error is posted below.
+    if (state == CONNECTING) {
+        mark(timings.connected);
+        metrics.count(Metrics::CONNECTIONS);
+        last_activity = millis();
+        state = SENDING_REQUEST;
+        sendData();
+    }
 
     lock.unlock();
     post_notifications();
@@ -224,10 +407,12 @@ void AsyncHTTPRequest::handleConnect() {
 
 
 void AsyncHTTPRequest::handleData(char* data, size_t length) {
-    DEBUG("Got TCP Data (" + length + " bytes).");
+    TRACE(TCP_DATA, length, state.load());
 
     auto lock = Lock(mutex);
 
+    metrics.count(Metrics::BYTES_RECEIVED, length);
+    last_activity = millis();
     switch (state) {
         case RECEIVING_STATUS_LINE:
         case RECEIVING_HEADERS: {
@@ -237,26 +422,37 @@ void AsyncHTTPRequest::handleData(char* data, size_t length) {
                 char line_buffer[HTTP_MAX_LINE_LENGTH];
                 auto line = buffer.readline(line_buffer, sizeof(line_buffer));
                 if (line == nullptr) {
+                    if (buffer.available() >= sizeof(line_buffer)) {
+                        handleError(ERROR_PROTOCOL, "line too long");
+                    }
                     break;
                 }
-                //DEBUG("Got line: '" + line + "'");
+                TRACE(HEADER_LINE, strlen(line), 0);
                 if (state == RECEIVING_STATUS_LINE) {
                     parseStatusLine(line);
                 } else {
                     parseHeader(line);
                 }
             }
-            return;
+            break;
         }
 
         case RECEIVING_BODY:
-            DEBUG("Received " + length + " bytes, buffer has " + responseBody->available() + ".");
-            if ((receivedDataHandler != nullptr || response_reader != nullptr) && responseBody->available() >= HTTP_READ_AHEAD) {
-                DEBUG("Delaying ACK of " + length + " bytes.");
+            processBodyData(data, length);
+            if (responseBody != nullptr) {
+                metrics.maximum(Metrics::BUFFER_HIGH_WATER, responseBody->available());
+            }
+            if ((receivedDataHandler != nullptr || response_reader != nullptr) && responseBody != nullptr && client != nullptr && responseBody->available() >= wakeup_high_water) {
+                TRACE(ACK_DELAYED, length, responseBody->available());
                 client->ackLater();
+                metrics.count(Metrics::ACKS_DELAYED);
                 unacknowledged_length += length;
+                delayed_ack = true;
+                // The reader may have drained the queue before seeing delayed_ack.
+                if (responseBody->available() < wakeup_high_water) {
+                    acknowledgeDelayed();
+                }
             }
-            processBodyData(data, length);
             break;
 
         default:
@@ -270,13 +466,16 @@ void AsyncHTTPRequest::handleData(char* data, size_t length) {
 
 
 void AsyncHTTPRequest::handleDisconnect() {
-    DEBUG("Got TCP Disconnected.");
+    TRACE(TCP_DISCONNECTED, state.load(), 0);
     auto lock = Lock(mutex);
 
+    auto old_client = client;
+    client = nullptr;
+
     switch (state) {
         case RECEIVING_BODY:
             if (!chunkedResponse && !haveContentLength) {
-                DEBUG("Request completed by disconnect");
+                TRACE(COMPLETED_BY_DISCONNECT, 0, 0);
                 requestCompleted();
                 break;
             }
@@ -286,8 +485,10 @@ void AsyncHTTPRequest::handleDisconnect() {
         case SENDING_BODY:
         case RECEIVING_STATUS_LINE:
         case RECEIVING_HEADERS:
-            DEBUG("Server closed connection prematurely");
-            handleError(ERROR_CONNECTION_CLOSED);
+            TRACE(CLOSED_PREMATURELY, state.load(), 0);
+            if (!resumeDownload()) {
+                handleError(ERROR_CONNECTION_CLOSED);
+            }
             break;
 
         case EMPTY:
@@ -295,25 +496,31 @@ void AsyncHTTPRequest::handleDisconnect() {
         case COMPLETE:
             break;
     }
-    delete client;
-    client = nullptr;
+    delete old_client;
+    account_objects();
 
     lock.unlock();
     post_notifications();
 }
 
 void AsyncHTTPRequest::handleError(int error_code) {
-    DEBUG("Got TCP Error" + error_code);
+    TRACE(TCP_ERROR, error_code, 0);
     auto lock = Lock(mutex);
 
+    auto old_client = client;
+    client = nullptr;
+
+    if (old_client == nullptr) {
+        return;
+    }
     if (state == CONNECTING) {
-        handleError(ERROR_CANNOT_CONNECT, client->errorToString(error_code));
+        handleError(ERROR_CANNOT_CONNECT, old_client->errorToString(error_code));
     }
-    else {
-        handleError(ERROR_CONNECTION_CLOSED, client->errorToString(error_code));
+    else if (!resumeDownload()) {
+        handleError(ERROR_CONNECTION_CLOSED, old_client->errorToString(error_code));
     }
-    delete client;
-    client = nullptr;
+    delete old_client;
+    account_objects();
 
     lock.unlock();
     post_notifications();
@@ -322,9 +529,16 @@ void AsyncHTTPRequest::handleError(int error_code) {
 
 void AsyncHTTPRequest::handleError(Error new_error, const char* detail) {
     if (state != ERROR) {
-        bool call_handler = state == EMPTY;
+        // Errors in send() are returned instead.
+        bool call_handler = state != EMPTY;
         current_error = new_error;
         state = ERROR;
+        cancelDeadline();
+        mark(timings.finished);
+        if (timings.started != 0) {
+            metrics.failed(new_error);
+            metrics.finished(timings);
+        }
 
         switch (error()) {
             case ERROR_OK:
@@ -345,17 +559,39 @@ void AsyncHTTPRequest::handleError(Error new_error, const char* detail) {
             case ERROR_CONNECTION_CLOSED:
                 lastErrorString = "Server closed connection";
                 break;
+            case ERROR_CACHE:
+                lastErrorString = "Cannot read cached response";
+                break;
+            case ERROR_WRITE:
+                lastErrorString = "Cannot write response body";
+                break;
+            case ERROR_DECODE:
+                lastErrorString = "Cannot decode response body";
+                break;
+            case ERROR_PROTOCOL:
+                lastErrorString = "Invalid response";
+                break;
+            case ERROR_ABORTED:
+                lastErrorString = "Request aborted";
+                break;
         }
         if (detail) {
             lastErrorString += ": ";
             lastErrorString += detail;
         }
 
-        DEBUG("Error: " + lastErrorString.c_str());
+        TRACE(REQUEST_ERROR, current_error, 0);
+
+        if (cache_recording_file) {
+            cache->abortFile(cache_key, cache_recording_file);
+        }
+        cache_recording.reset();
+        account_objects();
 
         if (call_handler) {
             notify_error = true;
         }
+        wakeReader();
     }
 }
 
@@ -363,24 +599,118 @@ void AsyncHTTPRequest::handleError(Error new_error, const char* detail) {
 void AsyncHTTPRequest::handleTimeout(int timeout) {
     auto lock = Lock(mutex);
 
-    DEBUG("Timeout");
+    TRACE(TCP_TIMEOUT, timeout, 0);
     (void)timeout;
-    handleError(ERROR_TIMEOUT);
-    delete client;
+    auto old_client = client;
     client = nullptr;
 
+    if (!resumeDownload()) {
+        handleError(ERROR_TIMEOUT);
+        if (bodyDiscarded()) {
+            freeBuffers();
+        }
+    }
+    delete old_client;
+    account_objects();
+
     lock.unlock();
     post_notifications();
 }
 
 
-void AsyncHTTPRequest::parseHeader(const char *line) {
+// Posts the error of a request that timed out in handleDeadline().
+void AsyncHTTPRequest::handlePoll() {
+    post_notifications();
+}
+
+
+void AsyncHTTPRequest::parseHeader(char *line) {
     if (line[0] == '\0') {
-        DEBUG("End of headers");
-        state = RECEIVING_BODY;
-        if (beginResponseHandler) {
-            DEBUG("Posting beginResponse notification.");
-            beginResponseHandler(this, status());
+        TRACE(END_OF_HEADERS, httpStatus, 0);
+        if (httpStatus >= 100 && httpStatus < 200) {
+            if (httpStatus == 101) {
+                handleError(ERROR_PROTOCOL, "unexpected protocol switch");
+                return;
+            }
+            // Interim response, the final one follows.
+            httpStatus = 0;
+            chunkedResponse = false;
+            haveContentLength = false;
+            haveTransferEncoding = false;
+            state = RECEIVING_STATUS_LINE;
+            return;
+        }
+        mark(timings.headers_received);
+        if (haveTransferEncoding) {
+            // Transfer-Encoding overrides Content-Length. Without chunked, the body ends when the connection is closed.
+            haveContentLength = false;
+        }
+        if (resume_offset > 0) {
+            if (httpStatus != 206 || contentRangeStart != rangeFirst + resume_offset) {
+                TRACE(CANNOT_RESUME, httpStatus, contentRangeStart);
+                handleError(ERROR_CONNECTION_CLOSED, httpStatus == 200 ? "resource changed" : "cannot resume download");
+                return;
+            }
+            httpStatus = resume_status;
+            state = RECEIVING_BODY;
+            char data[HTTP_BUFFER_FRAGMENT_SIZE];
+            size_t length;
+            while ((length = buffer.read(data, sizeof(data))) > 0) {
+                processBodyData(data, length);
+            }
+            return;
+        }
+
+        auto not_modified = httpStatus == 304 && cache_candidate;
+        auto no_body = request_method == "HEAD" || httpStatus == 204 || httpStatus == 304 || (!chunkedResponse && haveContentLength && responseContentLength == 0);
+        if (not_modified) {
+            TRACE(NOT_MODIFIED, 0, 0);
+            serveFromCache();
+        }
+        else {
+            state = RECEIVING_BODY;
+            if (cache != nullptr && !cache_key.empty() && httpStatus == 200 && response_cacheable && (!response_etag.empty() || !response_last_modified.empty())) {
+                auto entry = std::make_shared<Cache::Entry>();
+                entry->url = cache_key;
+                entry->status = httpStatus;
+                entry->content_type = response_content_type;
+                entry->etag = response_etag;
+                entry->last_modified = response_last_modified;
+                cache_recording_body = !haveContentLength || entry->size() + responseContentLength <= cache->maxSize();
+                if (haveContentLength && cache_recording_body) {
+                    entry->body.reserve(responseContentLength);
+                }
+                cache_recording_file = cache->beginFile(cache_key);
+                if (cache_recording_body || cache_recording_file) {
+                    cache_recording = entry;
+                }
+            }
+            if (response_etag.compare(0, 2, "W/") != 0) {
+                resume_validator = response_etag;
+            }
+            if (resume_validator.empty()) {
+                resume_validator = response_last_modified;
+            }
+            if (inflate_window_size > 0 && !no_body) {
+                if (strcasecmp(response_content_encoding.c_str(), "gzip") == 0 || strcasecmp(response_content_encoding.c_str(), "x-gzip") == 0) {
+                    inflater = new Inflater(&decodedBody, FORMAT_GZIP, inflate_window_size);
+                }
+                else if (strcasecmp(response_content_encoding.c_str(), "deflate") == 0) {
+                    inflater = new Inflater(&decodedBody, FORMAT_DEFLATE, inflate_window_size);
+                }
+            }
+        }
+        cache_candidate.reset();
+        account_objects();
+        notify_begin = true;
+        if (not_modified) {
+            buffer.clear();
+            return;
+        }
+        if (no_body) {
+            buffer.clear();
+            requestCompleted();
+            return;
         }
         char data[HTTP_BUFFER_FRAGMENT_SIZE];
         size_t length;
@@ -391,29 +721,87 @@ void AsyncHTTPRequest::parseHeader(const char *line) {
     }
 
     auto value = strchr(line, ':');
-    if (value == nullptr) {
-        // TODO: invalid header
+    if (value == nullptr || value == line) {
+        handleError(ERROR_PROTOCOL, "invalid header");
+        return;
+    }
+    if (strcspn(line, " \t") < static_cast<size_t>(value - line)) {
+        // No whitespace is allowed in names or before the colon, this also rejects obsolete line folding.
+        handleError(ERROR_PROTOCOL, "invalid header");
         return;
     }
     *value = '\0';
     value += 1;
     value += strspn(value, " \t");
+    auto end = value + strlen(value);
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+        end -= 1;
+    }
+    *end = '\0';
 
     if (strcasecmp(line, "Content-Length") == 0) {
-        responseContentLength = parseInteger(value);
-        DEBUG("Got Content-Length " + responseContentLength);
+        auto digits = strspn(value, "0123456789");
+        // At most 9 digits so it can't overflow size_t.
+        if (digits == 0 || digits > 9 || value[digits] != '\0') {
+            handleError(ERROR_PROTOCOL, "invalid Content-Length");
+            return;
+        }
+        auto length = resume_offset + parseInteger(value);
+        if (haveContentLength && length != responseContentLength) {
+            handleError(ERROR_PROTOCOL, "conflicting Content-Length");
+            return;
+        }
+        responseContentLength = length;
+        TRACE(CONTENT_LENGTH, responseContentLength, 0);
         haveContentLength = true;
     }
+    else if (strcasecmp(line, "Content-Encoding") == 0) {
+        response_content_encoding = value;
+    }
     else if (strcasecmp(line, "Content-Type") == 0) {
         response_content_type = value;
-        DEBUG("Got Content-Type '" + response_content_type.c_str() + "'");
+        TRACE(CONTENT_TYPE, response_content_type.size(), 0);
     }
     else if (strcasecmp(line, "Transfer-Encoding") == 0) {
-        if (strcasecmp(value, "chunked") == 0) {
-            chunkedResponse = true;
-            inChunkSize = true;
+        // Only the last coding of all Transfer-Encoding headers decides whether the body is chunked.
+        auto last = strrchr(value, ',');
+        last = last == nullptr ? value : last + 1 + strspn(last + 1, " \t");
+        haveTransferEncoding = true;
+        chunkedResponse = strcasecmp(last, "chunked") == 0;
+        if (chunkedResponse) {
+            chunkState = CHUNK_SIZE_START;
             chunkSize = 0;
-            DEBUG("Got chunked response");
+            TRACE(CHUNKED, 0, 0);
+        }
+    }
+    else if (strcasecmp(line, "Accept-Ranges") == 0) {
+        rangesSupported = strcasecmp(value, "none") != 0;
+    }
+    else if (strcasecmp(line, "Content-Range") == 0) {
+        if (strncasecmp(value, "bytes", 5) == 0) {
+            value += 5;
+            value += strspn(value, " \t");
+            contentRangeStart = parseInteger(value);
+            auto slash = strchr(value, '/');
+            if (slash != nullptr) {
+                contentRangeTotal = parseInteger(slash + 1);
+            }
+        }
+    }
+    else if (strcasecmp(line, "ETag") == 0) {
+        response_etag = value;
+    }
+    else if (strcasecmp(line, "Last-Modified") == 0) {
+        response_last_modified = value;
+    }
+    else if (strcasecmp(line, "Cache-Control") == 0) {
+        while (*value != '\0') {
+            auto length = strcspn(value, ",");
+            if (length == 8 && strncasecmp(value, "no-store", length) == 0) {
+                response_cacheable = false;
+            }
+            value += length;
+            value += strspn(value, ", \t");
         }
     }
 }
@@ -430,126 +818,555 @@ size_t AsyncHTTPRequest::parseInteger(const char *string) {
 }
 
 void AsyncHTTPRequest::parseStatusLine(const char *line) {
-    line = strchr(line, ' ');
-    if (line == nullptr) {
-        // TODO: handle invalid HTTP line
+    // HTTP/1.x followed by a three digit status code.
+    if (strncmp(line, "HTTP/1.", 7) != 0 || !isdigit(line[7]) || line[8] != ' ' || !isdigit(line[9]) || !isdigit(line[10]) || !isdigit(line[11]) || (line[12] != ' ' && line[12] != '\0')) {
+        handleError(ERROR_PROTOCOL, "invalid status line");
         return;
     }
-    line += strspn(line, " ");
-    httpStatus = parseInteger(line);
-    DEBUG("Got HTTP status " + httpStatus);
+    httpStatus = parseInteger(line + 9);
+    TRACE(STATUS, httpStatus, 0);
+    mark(timings.status_received);
     state = RECEIVING_HEADERS;
 }
 
 
 void AsyncHTTPRequest::processBodyData(char* data, size_t length) {
-    DEBUG("Got body data (" + length + ")");
+    TRACE(BODY_DATA, length, 0);
+    if (state != RECEIVING_BODY) {
+        return;
+    }
+    mark(timings.body_started);
 #ifdef DEBUG_HTTP_FULL
     Serial.write(data, length);
 #endif
-    if (haveContentLength && dataReceived + length > responseContentLength) {
-        length = responseContentLength - dataReceived;
+    if (chunkedResponse) {
+        processChunkedBodyData(data, length);
+        return;
     }
 
-    if (responseBody == nullptr) {
-        responseBody = new Buffer();
+    if (haveContentLength && dataReceived + length > responseContentLength) {
+        length = responseContentLength - dataReceived;
     }
-    DEBUG("Writing " + length + " bytes to reqeustBody buffer");
-    responseBody->write(data, length);
-    dataReceived += length;
 
-    notify_data = true;
-    if (reader_task != nullptr) {
-        DEBUG("Waking up reader.");
-        xTaskNotifyGive(reader_task);
-        reader_task = nullptr;
-    }
+    processBodyContent(data, length);
 
-    if (haveContentLength && dataReceived >= responseContentLength) {
+    if (state == RECEIVING_BODY && haveContentLength && dataReceived >= responseContentLength) {
         requestCompleted();
     }
 }
 
 
 void AsyncHTTPRequest::processChunkedBodyData(char* data, size_t length) {
-    while (length > 0) {
-        if (inChunkSize) {
-            auto i = 0;
-            while (i < length && isdigit(data[i])) {
-                chunkSize = chunkSize * 10 + (data[i] - '0');
-                i += 1;
-            }
-            while (i < length) {
-                if (data[i] == '\r') {
-                    continue;
-                } else if (data[i] == '\n') {
-                    inChunkSize = false;
-                    if (chunkSize == 0) {
-                        requestCompleted();
-                        return;
-                    }
-                    data += i;
-                    length -= i;
-                } else {
-                    // TODO: invalid character in chunk size
-                }
-                i += 1;
-            }
-        }
-        else {
+    while (length > 0 && state == RECEIVING_BODY) {
+        if (chunkState == CHUNK_DATA) {
             auto data_length = length < chunkSize ? length : chunkSize;
-            processBodyData(data, data_length);
+            processBodyContent(data, data_length);
             data += data_length;
             length -= data_length;
             chunkSize -= data_length;
             if (chunkSize == 0) {
-                inChunkSize = true;
+                chunkState = CHUNK_DATA_END;
             }
+            continue;
         }
-    }
-}
 
+        auto c = *data;
+        data += 1;
+        length -= 1;
 
-void AsyncHTTPRequest::requestCompleted() {
-    DEBUG("Request complete");
-    state = COMPLETE;
-    notify_complete = true;
-}
+        switch (chunkState) {
+            case CHUNK_SIZE_START:
+                if (!isxdigit(c)) {
+                    handleError(ERROR_PROTOCOL, "invalid chunk size");
+                    return;
+                }
+                chunkState = CHUNK_SIZE;
+                // fallthrough
+            case CHUNK_SIZE:
+            case CHUNK_EXTENSION:
+                if (c == '\n') {
+                    chunkState = chunkSize > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+                }
+                else if (chunkState == CHUNK_EXTENSION) {
+                    // ignored
+                }
+                else if (isxdigit(c)) {
+                    if (chunkSize > (SIZE_MAX >> 4)) {
+                        handleError(ERROR_PROTOCOL, "chunk too large");
+                        return;
+                    }
+                    chunkSize = chunkSize * 16 + (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+                }
+                else if (c == ';' || c == ' ' || c == '\t' || c == '\r') {
+                    chunkState = CHUNK_EXTENSION;
+                }
+                else {
+                    handleError(ERROR_PROTOCOL, "invalid chunk size");
+                    return;
+                }
+                break;
 
+            case CHUNK_DATA_END:
+                if (c == '\n') {
+                    chunkState = CHUNK_SIZE_START;
+                }
+                else if (c != '\r') {
+                    handleError(ERROR_PROTOCOL, "missing end of chunk");
+                    return;
+                }
+                break;
 
-void AsyncHTTPRequest::sendData() {
-    if (state == SENDING_REQUEST) {
-        if (sendData(&buffer)) {
-            if (requestBody != nullptr) {
-                DEBUG("Sending body");
-                state = SENDING_BODY;
-            }
-            else {
-                DEBUG("Receiving response");
-                state = RECEIVING_STATUS_LINE;
-            }
+            case CHUNK_TRAILER:
+                if (c == '\n') {
+                    requestCompleted();
+                    return;
+                }
+                else if (c != '\r') {
+                    chunkState = CHUNK_TRAILER_LINE;
+                }
+                break;
+
+            case CHUNK_TRAILER_LINE:
+                if (c == '\n') {
+                    chunkState = CHUNK_TRAILER;
+                }
+                break;
+
+            case CHUNK_DATA:
+                break;
         }
     }
+}
 
-    if (state == SENDING_BODY) {
-        if (sendData(requestBody)) {
-            DEBUG("Receiving response");
-            state = RECEIVING_STATUS_LINE;
+
+void AsyncHTTPRequest::processBodyContent(const char* data, size_t length) {
+    dataReceived += length;
+
+    if (inflater != nullptr) {
+        if (!inflater->write(data, length) && state != ERROR) {
+            handleError(ERROR_DECODE);
         }
     }
+    else {
+        deliverBodyData(data, length);
+    }
+}
+
+
+bool AsyncHTTPRequest::deliverBodyData(const char* data, size_t length) {
+    if (sink != nullptr) {
+        if (!sink->write(data, length)) {
+            handleError(ERROR_WRITE);
+            return false;
+        }
+    }
+    else {
+        responseBody->write(data, length);
+    }
+    bodyReceived += length;
+
+    if (cache_recording) {
+        if (cache_recording_body) {
+            if (cache_recording->size() + length > cache->maxSize()) {
+                TRACE(CACHE_TOO_LARGE, cache_recording->size() + length, 0);
+                cache_recording_body = false;
+                std::string().swap(cache_recording->body);
+            }
+            else {
+                cache_recording->body.append(data, length);
+            }
+        }
+        if (cache_recording_file && cache_recording_file.write(reinterpret_cast<const uint8_t*>(data), length) != length) {
+            TRACE(CACHE_WRITE_FAILED, 0, 0);
+            cache->abortFile(cache_key, cache_recording_file);
+        }
+        if (!cache_recording_body && !cache_recording_file) {
+            cache_recording.reset();
+        }
+    }
+
+    notifyDataAvailable();
+    return true;
+}
+
+
+// Data passed to a sink is always reported, queued data only in batches.
+void AsyncHTTPRequest::notifyDataAvailable() {
+    auto available = responseBody != nullptr ? responseBody->available() : wakeup_low_water;
+
+    if (available >= wakeup_low_water || (wakeup_max_delay > 0 && millis() - last_data_notification >= wakeup_max_delay)) {
+        notify_data = true;
+        last_data_notification = millis();
+    }
+    // The reader sets its threshold before registering.
+    if (reader_task != nullptr && available >= reader_threshold) {
+        wakeReader();
+    }
+}
+
+
+// Only the reader may call this. Returns false once the body has been discarded.
+bool AsyncHTTPRequest::acquireBody() {
+    if (body_access != BODY_READING) {
+        auto idle = BODY_IDLE;
+        if (!body_access.compare_exchange_strong(idle, BODY_READING)) {
+            return false;
+        }
+    }
+    if (bodyDiscarded()) {
+        body_peeked = false;
+        releaseBody();
+        return false;
+    }
+    return true;
+}
+
+
+// Keeps the body while a span returned by peekBody() is in use.
+void AsyncHTTPRequest::releaseBody() {
+    if (body_peeked) {
+        return;
+    }
+    body_access = BODY_IDLE;
+    // The request may have failed while the body was in use.
+    if (bodyDiscarded()) {
+        auto lock = Lock(mutex);
+        freeDiscardedBody();
+        account_objects();
+    }
+}
+
+
+// Must be called with the lock held.
+void AsyncHTTPRequest::freeDiscardedBody() {
+    auto idle = BODY_IDLE;
+    if (body_access.compare_exchange_strong(idle, BODY_FREED)) {
+        delete responseBody;
+        responseBody = nullptr;
+    }
+}
+
+
+// Frees what a request that was aborted or timed out no longer needs. Must be called with the lock held.
+void AsyncHTTPRequest::freeBuffers() {
+    freeDiscardedBody();
+    buffer.clear();
+    compressedBody.clear();
+    delete requestBody;
+    requestBody = nullptr;
+    delete deflater;
+    deflater = nullptr;
+    delete inflater;
+    inflater = nullptr;
+    account_objects();
+}
+
+
+// Gets body data without consuming it, from the queue or a response cached in memory.
+const char* AsyncHTTPRequest::peekBody(size_t* length) {
+    if (!acquireBody()) {
+        *length = 0;
+        return nullptr;
+    }
+    body_peeked = false;
+    if (responseBody != nullptr && responseBody->available() > 0) {
+        body_peeked = true;
+        return responseBody->peek(length);
+    }
+    releaseBody();
+    if (state == COMPLETE && cached_response && !cached_response_file) {
+        auto& body = cached_response->body;
+        if (*length > body.size() - cached_response_offset) {
+            *length = body.size() - cached_response_offset;
+        }
+        if (*length > 0) {
+            return body.data() + cached_response_offset;
+        }
+    }
+    *length = 0;
+    return nullptr;
+}
+
+
+void AsyncHTTPRequest::consumeBody(size_t length) {
+    if (!acquireBody()) {
+        return;
+    }
+    body_peeked = false;
+    if (responseBody != nullptr && responseBody->available() > 0) {
+        responseBody->consume(length);
+        if (delayed_ack && responseBody->available() < wakeup_high_water) {
+            auto lock = Lock(mutex);
+            acknowledgeDelayed();
+        }
+    }
+    else {
+        cached_response_offset += length;
+    }
+    releaseBody();
+}
+
+
+void AsyncHTTPRequest::wakeReader() {
+    auto task = reader_task.exchange(nullptr);
+    if (task != nullptr) {
+        TRACE(READER_WOKEN, 0, 0);
+        xTaskNotifyGive(task);
+    }
+}
+
+
+void AsyncHTTPRequest::acknowledgeDelayed() {
+    if (unacknowledged_length > 0 && client != nullptr) {
+        TRACE(ACK_SENT, unacknowledged_length, 0);
+        client->ack(unacknowledged_length);
+    }
+    unacknowledged_length = 0;
+    delayed_ack = false;
+    // The server couldn't send while the ACKs were delayed.
+    last_activity = millis();
+}
+
+
+void AsyncHTTPRequest::setTimeouts(uint32_t connect_ms, uint32_t headers_ms, uint32_t idle_ms, uint32_t total_ms) {
+    connect_timeout = connect_ms;
+    headers_timeout = headers_ms;
+    idle_timeout = idle_ms;
+    total_timeout = total_ms;
+}
+
+
+void AsyncHTTPRequest::armDeadline() {
+    const char* expired = nullptr;
+    auto delay = nextDeadline(millis(), &expired);
+    if (delay != UINT32_MAX) {
+        timer_wheel.arm(&deadline_timer, delay);
+    }
+}
+
+
+void AsyncHTTPRequest::cancelDeadline(bool wait) {
+    if (connect_timeout > 0 || headers_timeout > 0 || idle_timeout > 0 || total_timeout > 0) {
+        timer_wheel.cancel(&deadline_timer, wait);
+    }
+}
+
+
+// Between connection attempts, deadlines only move later, so the timer may fire early but never late.
+// connect() re-arms it. While ACKs are delayed, the idle deadline is kept pending from now.
+uint32_t AsyncHTTPRequest::nextDeadline(uint32_t now, const char** expired) const {
+    struct Deadline {
+        uint32_t timeout;
+        uint32_t since;
+        bool active;
+        const char* name;
+    };
+    Deadline deadlines[] = {
+        {connect_timeout, connect_started, state == CONNECTING, "connect"},
+        {headers_timeout, connect_started, state < RECEIVING_BODY, "response headers"},
+        {idle_timeout, delayed_ack ? now : last_activity, true, "idle"},
+        {total_timeout, request_started, true, "request"}
+    };
+    auto next = UINT32_MAX;
+
+    for (auto& deadline : deadlines) {
+        if (deadline.timeout == 0 || !deadline.active) {
+            continue;
+        }
+        auto elapsed = now - deadline.since;
+        if (elapsed >= deadline.timeout) {
+            *expired = deadline.name;
+            return 0;
+        }
+        if (deadline.timeout - elapsed < next) {
+            next = deadline.timeout - elapsed;
+        }
+    }
+
+    return next;
+}
+
+
+// Runs on the timer task, which must not block or call handlers. The request fails here, which also works
+// before the connection exists, and the network task posts the error at the connection's next event or poll.
+void AsyncHTTPRequest::handleDeadline() {
+    auto lock = Lock(mutex);
+
+    if (state == EMPTY || isComplete()) {
+        return;
+    }
+
+    const char* expired = nullptr;
+    auto delay = nextDeadline(millis(), &expired);
+    if (expired != nullptr) {
+        TRACE(TCP_TIMEOUT, 0, 0);
+        handleError(ERROR_TIMEOUT, expired);
+        freeBuffers();
+    }
+    else if (delay != UINT32_MAX) {
+        timer_wheel.arm(&deadline_timer, delay);
+    }
+}
+
+
+void AsyncHTTPRequest::requestCompleted() {
+    if (inflater != nullptr && !inflater->finish()) {
+        if (state != ERROR) {
+            handleError(ERROR_DECODE);
+        }
+        return;
+    }
+    if (sink != nullptr && !sink->finish()) {
+        handleError(ERROR_WRITE);
+        return;
+    }
+
+    TRACE(REQUEST_COMPLETE, bodyReceived, 0);
+    cancelDeadline();
+    mark(timings.finished);
+    metrics.count(Metrics::REQUESTS_COMPLETED);
+    metrics.finished(timings);
+    account_objects();
+    state = COMPLETE;
+    notify_complete = true;
+    if (responseBody != nullptr && responseBody->available() > 0) {
+        notify_data = true;
+    }
+    wakeReader();
+
+    if (cache_recording) {
+        TRACE(CACHE_STORE, cache_recording->size(), 0);
+        if (cache_recording_file) {
+            cache->commitFile(*cache_recording, cache_recording_file);
+        }
+        if (cache_recording_body) {
+            cache->store(cache_recording);
+        }
+        cache_recording.reset();
+    }
+}
+
+
+void AsyncHTTPRequest::serveFromCache() {
+    metrics.count(Metrics::CACHE_HITS);
+    cached_response = cache_candidate;
+    cached_response_offset = 0;
+
+    if (!cached_response->file.empty()) {
+        cached_response_file = cache->filesystem->open(cached_response->file.c_str(), "r");
+        if (!cached_response_file) {
+            handleError(ERROR_CACHE, cached_response->file.c_str());
+            return;
+        }
+    }
+
+    httpStatus = cached_response->status;
+    response_content_type = cached_response->content_type;
+    responseContentLength = cached_response->length();
+    haveContentLength = true;
+    dataReceived = responseContentLength;
+    bodyReceived = responseContentLength;
+
+    if (sink != nullptr) {
+        // A sink gets the cached body like a received one, it isn't read.
+        size_t written = 0;
+        if (cached_response_file) {
+            char data[HTTP_BUFFER_FRAGMENT_SIZE];
+            size_t length;
+            while ((length = cached_response_file.read(reinterpret_cast<uint8_t*>(data), sizeof(data))) > 0) {
+                if (!sink->write(data, length)) {
+                    handleError(ERROR_WRITE);
+                    return;
+                }
+                written += length;
+            }
+            cached_response_file.close();
+        }
+        else {
+            auto& body = cached_response->body;
+            if (!body.empty() && !sink->write(body.data(), body.size())) {
+                handleError(ERROR_WRITE);
+                return;
+            }
+            written = body.size();
+            cached_response_offset = written;
+        }
+        if (written != responseContentLength) {
+            handleError(ERROR_CACHE, cached_response->file.c_str());
+            return;
+        }
+    }
+
+    notify_data = true;
+    requestCompleted();
+}
+
+
+void AsyncHTTPRequest::sendData() {
+    if (client == nullptr) {
+        // Closed by an error or abort().
+        return;
+    }
+
+    if (state == SENDING_REQUEST) {
+        mark(timings.sending);
+        if (sendData(&buffer)) {
+            if (requestBody != nullptr) {
+                TRACE(SENDING_BODY, requestBody->available(), 0);
+                state = SENDING_BODY;
+            }
+            else {
+                TRACE(RECEIVING_RESPONSE, 0, 0);
+                state = RECEIVING_STATUS_LINE;
+            }
+        }
+    }
+
+    if (state == SENDING_BODY) {
+        if (deflater != nullptr) {
+            // Compress more of the body whenever everything compressed so far has been sent.
+            while (sendData(&compressedBody)) {
+                if (body_compressed) {
+                    TRACE(RECEIVING_RESPONSE, 0, 0);
+                    state = RECEIVING_STATUS_LINE;
+                    break;
+                }
+                size_t length = HTTP_BUFFER_FRAGMENT_SIZE;
+                auto data = requestBody->get(&length);
+                if (data != nullptr) {
+                    deflater->write(data, length);
+                    requestBody->consume(length);
+                }
+                else {
+                    deflater->finish();
+                    compressedBody.print("0\r\n\r\n");
+                    body_compressed = true;
+                }
+            }
+        }
+        else if (sendData(requestBody)) {
+            TRACE(RECEIVING_RESPONSE, 0, 0);
+            state = RECEIVING_STATUS_LINE;
+        }
+    }
+
+    if (state == RECEIVING_STATUS_LINE) {
+        mark(timings.sent);
+    }
+    client->send();
 }
 
 
 bool AsyncHTTPRequest::sendData(Buffer* buffer) {
 #if 0
     if (!client->canSend()) {
-        DEBUG("Can't send data");
+        TRACE(SENDING, 0, 0);
         return false;
     }
 #endif
     size_t to_send = client->space();
 
-    DEBUG("Sending up to " + to_send + " bytes");
+    TRACE(SENDING, to_send, 0);
 
     while (to_send > 0) {
         auto length = to_send;
@@ -565,6 +1382,7 @@ bool AsyncHTTPRequest::sendData(Buffer* buffer) {
             return false;
         }
         buffer->consume(length);
+        metrics.count(Metrics::BYTES_SENT, length);
         to_send -= length;
     }
 
@@ -572,10 +1390,113 @@ bool AsyncHTTPRequest::sendData(Buffer* buffer) {
 }
 
 
+AsyncHTTPRequest::Queue::~Queue() {
+    while (head != nullptr) {
+        auto next = head->next;
+        deleteFragment(head);
+        head = next;
+    }
+}
+
+
+void AsyncHTTPRequest::Queue::write(const char* data, size_t length) {
+    auto position = end.load(std::memory_order_relaxed);
+
+    while (length > 0) {
+        if (position - tail_start == HTTP_BUFFER_FRAGMENT_SIZE) {
+            tail->next = newFragment();
+            tail = tail->next;
+            tail_start += HTTP_BUFFER_FRAGMENT_SIZE;
+        }
+        auto offset = position - tail_start;
+        auto n = HTTP_BUFFER_FRAGMENT_SIZE - offset;
+        if (n > length) {
+            n = length;
+        }
+        memcpy(tail->data + offset, data, n);
+        data += n;
+        length -= n;
+        position += n;
+        // Publishes the data and the link to a new fragment.
+        end.store(position, std::memory_order_release);
+    }
+}
+
+
+const char* AsyncHTTPRequest::Queue::peek(size_t* length) {
+    auto position = start.load(std::memory_order_relaxed);
+    auto available = end.load(std::memory_order_acquire) - position;
+
+    if (*length > available) {
+        *length = available;
+    }
+    if (*length == 0) {
+        return nullptr;
+    }
+
+    if (position - head_start == HTTP_BUFFER_FRAGMENT_SIZE) {
+        auto fragment = head;
+        head = head->next;
+        head_start += HTTP_BUFFER_FRAGMENT_SIZE;
+        deleteFragment(fragment);
+    }
+    auto offset = position - head_start;
+    if (*length > HTTP_BUFFER_FRAGMENT_SIZE - offset) {
+        *length = HTTP_BUFFER_FRAGMENT_SIZE - offset;
+    }
+    return head->data + offset;
+}
+
+
+size_t AsyncHTTPRequest::Queue::read(char* data, size_t length) {
+    auto position = start.load(std::memory_order_relaxed);
+    auto available = end.load(std::memory_order_acquire) - position;
+    size_t bytes_read = 0;
+
+    if (length > available) {
+        length = available;
+    }
+
+    while (bytes_read < length) {
+        if (position - head_start == HTTP_BUFFER_FRAGMENT_SIZE) {
+            auto fragment = head;
+            head = head->next;
+            head_start += HTTP_BUFFER_FRAGMENT_SIZE;
+            deleteFragment(fragment);
+        }
+        auto offset = position - head_start;
+        auto n = HTTP_BUFFER_FRAGMENT_SIZE - offset;
+        if (n > length - bytes_read) {
+            n = length - bytes_read;
+        }
+        if (data != nullptr) {
+            memcpy(data + bytes_read, head->data + offset, n);
+        }
+        bytes_read += n;
+        position += n;
+    }
+
+    start = position;
+    return bytes_read;
+}
+
+
+AsyncHTTPRequest::Buffer::Fragment* AsyncHTTPRequest::Buffer::newFragment() {
+    usage->allocated(sizeof(Fragment));
+    return new Fragment();
+}
+
+
+void AsyncHTTPRequest::Buffer::deleteFragment(Fragment* fragment) {
+    delete fragment;
+    usage->released(sizeof(Fragment));
+}
+
+
 void AsyncHTTPRequest::Buffer::clear() {
     while (first != nullptr) {
         auto next = first->next;
-        delete first;
+        deleteFragment(first);
         first = next;
     }
     last = nullptr;
@@ -622,13 +1543,13 @@ size_t AsyncHTTPRequest::Buffer::read(char* data, size_t length) {
         if ((start % HTTP_BUFFER_FRAGMENT_SIZE) == 0) {
             auto fragment = first;
             first = first->next;
-            delete fragment;
+            deleteFragment(fragment);
         }
     }
 
     if (start == end) {
         if (first != nullptr) {
-            delete first;
+            deleteFragment(first);
         }
         first = last = nullptr;
         start = end = 0;
@@ -639,48 +1560,36 @@ size_t AsyncHTTPRequest::Buffer::read(char* data, size_t length) {
 
 
 char* AsyncHTTPRequest::Buffer::readline(char *data, size_t length) {
-    size_t n = 0;
     size_t i = start % HTTP_BUFFER_FRAGMENT_SIZE;
     auto fragment = first;
     bool cr = false;
 
-    while (fragment || i < (end % HTTP_BUFFER_FRAGMENT_SIZE)) {
-        n += 1;
-        if (fragment->data[i] == '\r') {
-            cr = true;
-        }
-        else if (fragment->data[i] == '\n') {
-            if (n > length) {
-                // TODO: handle too long line
-                n = length;
-                cr = false;
-            }
+    for (size_t n = 1; n <= length && n <= available(); n++) {
+        if (fragment->data[i] == '\n') {
             read(data, n);
             data[n - (cr ? 2 : 1)] = '\0';
             return data;
         }
-        else {
-            cr = false;
-        }
+        cr = fragment->data[i] == '\r';
         i += 1;
-        if (i >= HTTP_BUFFER_FRAGMENT_SIZE) {
+        if (i == HTTP_BUFFER_FRAGMENT_SIZE) {
             fragment = fragment->next;
             i = 0;
         }
     }
 
-    return NULL;
+    return nullptr;
 }
 
 
 void AsyncHTTPRequest::Buffer::write(const char* data, size_t length) {
     while (length > 0) {
         if (first == nullptr) {
-            first = new Fragment();
+            first = newFragment();
             last = first;
         }
         else if ((end % HTTP_BUFFER_FRAGMENT_SIZE) == 0) {
-            last->next = new Fragment();
+            last->next = newFragment();
             last = last->next;
         }
         auto offset = end % HTTP_BUFFER_FRAGMENT_SIZE;
@@ -696,95 +1605,1212 @@ void AsyncHTTPRequest::Buffer::write(const char* data, size_t length) {
 }
 
 
-AsyncHTTPRequest::URL::URL(const char *url) {
-    const char *colon = strchr(url, ':');
-
-    if (colon == nullptr) {
-        scheme = url;
-        return;
-    }
-
-    scheme = std::string(url, colon - url);
+bool AsyncHTTPRequest::ChunkedBody::write(const char* data, size_t length) {
+    char size[12];
+    snprintf(size, sizeof(size), "%x\r\n", static_cast<unsigned int>(length));
+    buffer->print(size);
+    buffer->write(data, length);
+    buffer->print("\r\n");
+    return true;
+}
 
-    auto rest = colon + 1;
 
-    if (rest[0] != '/' || rest[1] != '/') {
-        path = rest;
-        return;
-    }
-    else {
-        rest += 2;
-    }
+bool AsyncHTTPRequest::BlockSink::write(const char* data, size_t length) {
+    while (length > 0) {
+        if (fill == 0 && length >= block_size) {
+            // Write whole blocks directly, without copying.
+            auto n = length - length % block_size;
+            if (!writeBlocks(offset, data, n)) {
+                return false;
+            }
+            offset += n;
+            data += n;
+            length -= n;
+            continue;
+        }
 
-    const char* slash = strchr(rest, '/');
-    if (slash == nullptr) {
-        slash = rest + strlen(rest);
-    }
-    colon = strchr(rest, ':');
-    if (colon != nullptr && colon < slash) {
-        port = parseInteger(colon + 1);
-    }
-    else {
-        colon = slash;
-        if (scheme == "http") {
-            port = 80;
+        if (block == nullptr) {
+            block = new char[block_size];
         }
-        else if (scheme == "https") {
-            port = 443;
+        auto n = block_size - fill;
+        if (n > length) {
+            n = length;
+        }
+        memcpy(block + fill, data, n);
+        fill += n;
+        data += n;
+        length -= n;
+
+        if (fill == block_size) {
+            if (!writeBlocks(offset, block, fill)) {
+                return false;
+            }
+            offset += fill;
+            fill = 0;
         }
     }
 
-    host = std::string(rest, colon - rest);
-    path = slash;
+    return true;
 }
 
 
-void AsyncHTTPRequest::close_client() {
-    if (client != nullptr) {
-        client->close();
-        delete client;
+bool AsyncHTTPRequest::BlockSink::finish() {
+    if (fill > 0) {
+        if (!writeBlocks(offset, block, fill)) {
+            return false;
+        }
+        offset += fill;
+        fill = 0;
+    }
+    delete[] block;
+    block = nullptr;
+
+    return true;
+}
+
+
+bool AsyncHTTPRequest::FileSink::finish() {
+    auto ok = BlockSink::finish();
+    file.close();
+    return ok;
+}
+
+
+bool AsyncHTTPRequest::FileSink::writeBlocks(size_t offset, const char* data, size_t length) {
+    (void)offset;
+    return file.write(reinterpret_cast<const uint8_t*>(data), length) == length;
+}
+
+
+#define HTTP_FLASH_SECTOR_SIZE 4096
+
+AsyncHTTPRequest::PartitionSink::PartitionSink(const esp_partition_t* partition, size_t block_size): BlockSink((block_size + HTTP_FLASH_SECTOR_SIZE - 1) / HTTP_FLASH_SECTOR_SIZE * HTTP_FLASH_SECTOR_SIZE), partition(partition) {
+}
+
+
+bool AsyncHTTPRequest::PartitionSink::writeBlocks(size_t offset, const char* data, size_t length) {
+    if (offset + length > partition->size) {
+        TRACE_FOR(0, PARTITION_FULL, offset, length);
+        return false;
+    }
+    auto erase_length = (length + HTTP_FLASH_SECTOR_SIZE - 1) / HTTP_FLASH_SECTOR_SIZE * HTTP_FLASH_SECTOR_SIZE;
+    if (esp_partition_erase_range(partition, offset, erase_length) != ESP_OK) {
+        return false;
+    }
+    return esp_partition_write(partition, offset, data, length) == ESP_OK;
+}
+
+
+AsyncHTTPRequest::ParallelDownload::ParallelDownload(Sink* sink, size_t connections, size_t range_size): sink(sink), connections(connections > 0 ? connections : 1), range_size(range_size) {
+    mutex = xSemaphoreCreateMutex();
+}
+
+
+AsyncHTTPRequest::ParallelDownload::~ParallelDownload() {
+    for (auto part : parts) {
+        delete part->request;
+        delete part;
+    }
+    for (auto part : aborted_parts) {
+        delete part->request;
+        delete part;
+    }
+    retireRequests();
+    if (mutex) {
+        vSemaphoreDelete(mutex);
+    }
+}
+
+
+AsyncHTTPRequest::Error AsyncHTTPRequest::ParallelDownload::start(const char* url) {
+    auto lock = Lock(mutex);
+
+    if (started) {
+        return ERROR_IN_USE;
+    }
+    started = true;
+    this->url = url;
+
+    // The response to the first range tells us the size of the resource.
+    return startPart(0, range_size);
+}
+
+
+AsyncHTTPRequest::Error AsyncHTTPRequest::ParallelDownload::startPart(size_t offset, size_t length) {
+    TRACE_FOR(0, PART_START, offset, length);
+    auto part = new Part(this, offset, length);
+    auto request = new AsyncHTTPRequest();
+    part->request = request;
+    parts.push_back(part);
+    next_offset = offset + length;
+
+    request->setSink(part);
+    request->setRange(offset, offset + length - 1);
+    request->resume_validator = validator;
+    request->onBeginResponse([this, part](AsyncHTTPRequest* request, int status) {
+        this->partResponse(part, status);
+    });
+    request->onCompletion([this, part](AsyncHTTPRequest* request) {
+        this->partCompleted(part);
+    });
+    request->onError([this, part](AsyncHTTPRequest* request, Error error) {
+        this->partFailed(part, error);
+    });
+
+    auto error = request->get(url.c_str());
+    if (error != ERROR_OK) {
+        parts.pop_back();
+        retired_requests.push_back(request);
+        delete part;
+    }
+    return error;
+}
+
+
+bool AsyncHTTPRequest::ParallelDownload::validStatus(const Part* part, int status) const {
+    if (part->offset == 0) {
+        return status == 200 || status == 206;
+    }
+    // Fetching ranges one at a time, the range after one ending exactly at the end of the resource is not satisfiable.
+    return status == 206 || (sequential && status == 416);
+}
+
+
+void AsyncHTTPRequest::ParallelDownload::partResponse(Part* part, int status) {
+    auto lock = Lock(mutex);
+
+    if (complete) {
+        // part has been deleted.
+        return;
+    }
+    if (!validStatus(part, status)) {
+        TRACE_FOR(part->request->traceId(), PART_BAD_STATUS, status, part->offset);
+        http_status = status;
+        finish(ERROR_CONNECTION_CLOSED);
+    }
+    else if (part->offset == 0) {
+        http_status = status;
+        if (status == 200) {
+            TRACE_FOR(part->request->traceId(), RANGES_UNSUPPORTED, 0, 0);
+            have_length = false;
+        }
+        else if (part->request->contentRangeTotal > 0) {
+            total_length = part->request->contentRangeTotal;
+            have_length = true;
+            validator = part->request->resume_validator;
+            schedule();
+        }
+        else {
+            // Content-Range total is "*" or missing.
+            sequential = true;
+            validator = part->request->resume_validator;
+        }
+    }
+
+    lock.unlock();
+    post_notifications();
+}
+
+
+bool AsyncHTTPRequest::ParallelDownload::writePart(Part* part, const char* data, size_t length) {
+    auto lock = Lock(mutex);
+
+    if (complete) {
+        return false;
+    }
+    // The body can arrive before partResponse() is called, don't write error pages to the sink.
+    // Refusing the data fails the request, which ends the download through partFailed().
+    auto status = part->request->status();
+    if (!validStatus(part, status)) {
+        http_status = status;
+        return false;
+    }
+    if (status == 416) {
+        return true;
+    }
+    if (status == 206 && part->received + length > part->length) {
+        TRACE_FOR(part->request->traceId(), PART_BAD_RANGE, status, part->offset);
+        return false;
+    }
+    part->received += length;
+    if (part == parts.front()) {
+        return sink->write(data, length);
+    }
+    part->data.write(data, length);
+    return true;
+}
+
+
+void AsyncHTTPRequest::ParallelDownload::partCompleted(Part* part) {
+    auto lock = Lock(mutex);
+
+    if (complete) {
+        // part has been deleted.
+        return;
+    }
+    auto status = part->request->status();
+    auto ranged = have_length || sequential;
+    // The first range is requested before the size is known.
+    auto expected = part->length;
+    if (have_length && expected > total_length - part->offset) {
+        expected = total_length - part->offset;
+    }
+    if (sequential && status == 416 && part->offset > 0) {
+        at_end = true;
+        total_length = part->offset;
+    }
+    else if (status != (ranged ? 206 : 200) || (ranged && part->request->contentRangeStart != part->offset) || (have_length && part->received != expected)) {
+        TRACE_FOR(part->request->traceId(), PART_BAD_RANGE, status, part->offset);
+        finish(ERROR_CONNECTION_CLOSED);
+        lock.unlock();
+        post_notifications();
+        return;
+    }
+    else if (sequential && part->received < part->length) {
+        at_end = true;
+        total_length = part->offset + part->received;
+    }
+
+    retireRequests();
+    part->complete = true;
+
+    // Write the parts received ahead of time that follow this one.
+    while (!parts.empty() && parts.front()->complete) {
+        auto done = parts.front();
+        parts.pop_front();
+        done->request->setSink(nullptr);
+        retired_requests.push_back(done->request);
+        delete done;
+
+        if (!parts.empty() && !flushPart(parts.front())) {
+            finish(ERROR_WRITE);
+            break;
+        }
+    }
+
+    schedule();
+
+    lock.unlock();
+    post_notifications();
+}
+
+
+bool AsyncHTTPRequest::ParallelDownload::flushPart(Part* part) {
+    size_t length;
+    while ((length = part->data.available()) > 0) {
+        auto data = part->data.get(&length);
+        if (!sink->write(data, length)) {
+            return false;
+        }
+        part->data.consume(length);
+    }
+    return true;
+}
+
+
+void AsyncHTTPRequest::ParallelDownload::partFailed(Part* part, Error error) {
+    auto lock = Lock(mutex);
+
+    finish(error);
+
+    lock.unlock();
+    post_notifications();
+}
+
+
+void AsyncHTTPRequest::ParallelDownload::schedule() {
+    if (current_error != ERROR_OK || complete) {
+        return;
+    }
+
+    while (have_length && parts.size() < connections && next_offset < total_length) {
+        auto length = total_length - next_offset;
+        if (length > range_size) {
+            length = range_size;
+        }
+        auto error = startPart(next_offset, length);
+        if (error != ERROR_OK) {
+            finish(error);
+            return;
+        }
+    }
+
+    if (sequential && !at_end && parts.empty()) {
+        auto error = startPart(next_offset, range_size);
+        if (error != ERROR_OK) {
+            finish(error);
+            return;
+        }
+    }
+
+    if (parts.empty()) {
+        finish(sink->finish() ? ERROR_OK : ERROR_WRITE);
+    }
+}
+
+
+void AsyncHTTPRequest::ParallelDownload::finish(Error error) {
+    if (complete) {
+        return;
+    }
+    complete = true;
+    current_error = error;
+
+    // Requests are deleted later, we may be called from one of their handlers.
+    for (auto part : parts) {
+        if (error != ERROR_OK && !part->complete) {
+            // Aborted in post_notifications(), writing to the part takes our lock while holding the request's.
+            aborted_parts.push_back(part);
+            continue;
+        }
+        retired_requests.push_back(part->request);
+        part->request->setSink(nullptr);
+        delete part;
+    }
+    parts.clear();
+    notify_complete = true;
+}
+
+
+// Called without the lock held.
+void AsyncHTTPRequest::ParallelDownload::post_notifications() {
+    auto lock = Lock(mutex);
+    std::list<Part*> aborted;
+    aborted.swap(aborted_parts);
+    auto complete = notify_complete;
+    notify_complete = false;
+    lock.unlock();
+
+    if (!aborted.empty()) {
+        for (auto part : aborted) {
+            part->request->abort();
+        }
+        lock.lock();
+        for (auto part : aborted) {
+            retired_requests.push_back(part->request);
+            part->request->setSink(nullptr);
+            delete part;
+        }
+        lock.unlock();
+    }
+
+    if (complete && completionHandler) {
+        completionHandler(this, current_error);
+    }
+}
+
+
+void AsyncHTTPRequest::ParallelDownload::retireRequests() {
+    for (auto request : retired_requests) {
+        delete request;
+    }
+    retired_requests.clear();
+}
+
+
+AsyncHTTPRequest::Cache::Cache(size_t max_size): max_size(max_size) {
+    mutex = xSemaphoreCreateMutex();
+}
+
+
+AsyncHTTPRequest::Cache::~Cache() {
+    if (mutex) {
+        vSemaphoreDelete(mutex);
+    }
+}
+
+
+void AsyncHTTPRequest::Cache::useFilesystem(fs::FS* filesystem, const char* directory, size_t max_size) {
+    auto lock = Lock(mutex);
+
+    this->filesystem = filesystem;
+    this->directory = directory;
+    max_file_size = max_size;
+    file_entries.clear();
+    file_index.clear();
+    current_file_size = 0;
+    file_index_loaded = false;
+}
+
+
+void AsyncHTTPRequest::Cache::clear() {
+    auto lock = Lock(mutex);
+
+    index.clear();
+    entries.clear();
+    current_size = 0;
+
+    if (filesystem != nullptr) {
+        loadFileIndex();
+        while (!file_entries.empty()) {
+            removeFile(file_entries.front().name);
+        }
+    }
+}
+
+
+void AsyncHTTPRequest::Cache::evict(size_t needed) {
+    while (!entries.empty() && current_size + needed > max_size) {
+        auto& entry = entries.back();
+        TRACE_FOR(0, CACHE_EVICT, entry->size(), 0);
+        current_size -= entry->size();
+        index.erase(entry->url);
+        entries.pop_back();
+    }
+}
+
+
+std::shared_ptr<const AsyncHTTPRequest::Cache::Entry> AsyncHTTPRequest::Cache::lookup(const std::string& url) {
+    auto lock = Lock(mutex);
+
+    auto it = index.find(url);
+    if (it == index.end()) {
+        return lookupFile(url);
+    }
+    entries.splice(entries.begin(), entries, it->second);
+    return *it->second;
+}
+
+
+void AsyncHTTPRequest::Cache::remove(const std::string& url) {
+    auto lock = Lock(mutex);
+
+    remove_prelocked(url);
+    if (filesystem != nullptr) {
+        loadFileIndex();
+        removeFile(fileName(url));
+    }
+}
+
+
+void AsyncHTTPRequest::Cache::remove_prelocked(const std::string& url) {
+    auto it = index.find(url);
+    if (it == index.end()) {
+        return;
+    }
+    current_size -= (*it->second)->size();
+    entries.erase(it->second);
+    index.erase(it);
+}
+
+
+void AsyncHTTPRequest::Cache::store(std::shared_ptr<const Entry> entry) {
+    auto lock = Lock(mutex);
+
+    remove_prelocked(entry->url);
+    if (entry->size() > max_size) {
+        return;
+    }
+    evict(entry->size());
+    entries.push_front(entry);
+    index[entry->url] = entries.begin();
+    current_size += entry->size();
+}
+
+
+// Each response is stored in two files: <name>.b contains the body, <name>.m the metadata, one field per line.
+// The body is written to <name>.t while it is received; the metadata file is written last.
+
+static bool readCacheMetadata(fs::File& file, AsyncHTTPRequest::Cache::Entry* entry) {
+    entry->url = file.readStringUntil('\n').c_str();
+    entry->status = atoi(file.readStringUntil('\n').c_str());
+    entry->content_type = file.readStringUntil('\n').c_str();
+    entry->etag = file.readStringUntil('\n').c_str();
+    entry->last_modified = file.readStringUntil('\n').c_str();
+    auto length = file.readStringUntil('\n');
+    entry->file_length = strtoul(length.c_str(), nullptr, 10);
+
+    return entry->status != 0 && length.length() > 0;
+}
+
+
+std::string AsyncHTTPRequest::Cache::fileName(const std::string& url) const {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (auto c : url) {
+        hash = (hash ^ static_cast<uint8_t>(c)) * 16777619u;
+    }
+
+    char name[9];
+    snprintf(name, sizeof(name), "%08x", static_cast<unsigned int>(hash));
+    return name;
+}
+
+
+std::string AsyncHTTPRequest::Cache::filePath(const std::string& name, const char* extension) const {
+    return directory + "/" + name + extension;
+}
+
+
+void AsyncHTTPRequest::Cache::loadFileIndex() {
+    if (file_index_loaded) {
+        return;
+    }
+    file_index_loaded = true;
+
+    filesystem->mkdir(directory.c_str());
+    auto dir = filesystem->open(directory.c_str());
+    if (!dir || !dir.isDirectory()) {
+        TRACE_FOR(0, CACHE_DIRECTORY_FAILED, 0, 0);
+        return;
+    }
+
+    std::list<std::string> stale;
+    std::list<std::string> bodies;
+    for (auto file = dir.openNextFile(); file; file = dir.openNextFile()) {
+        std::string name = file.name();
+        auto slash = name.rfind('/');
+        if (slash != std::string::npos) {
+            name = name.substr(slash + 1);
+        }
+        if (name.size() != 10 || name[8] != '.') {
+            continue;
+        }
+        auto extension = name[9];
+        name.resize(8);
+        if (extension == 'm') {
+            Entry entry;
+            if (readCacheMetadata(file, &entry)) {
+                auto size = entry.size() + entry.file_length;
+                file_entries.push_back(FileEntry{name, size});
+                file_index[name] = std::prev(file_entries.end());
+                current_file_size += size;
+            }
+            else {
+                stale.push_back(name + ".m");
+            }
+        }
+        else if (extension == 'b') {
+            bodies.push_back(name);
+        }
+        else if (extension == 't') {
+            stale.push_back(name + ".t");
+        }
+    }
+    dir.close();
+
+    for (auto& name : bodies) {
+        if (file_index.count(name) == 0) {
+            stale.push_back(name + ".b");
+        }
+    }
+
+    for (auto& name : stale) {
+        filesystem->remove((directory + "/" + name).c_str());
+    }
+}
+
+
+std::shared_ptr<const AsyncHTTPRequest::Cache::Entry> AsyncHTTPRequest::Cache::lookupFile(const std::string& url) {
+    if (filesystem == nullptr) {
+        return nullptr;
+    }
+    loadFileIndex();
+
+    auto name = fileName(url);
+    auto it = file_index.find(name);
+    if (it == file_index.end()) {
+        return nullptr;
+    }
+
+    auto file = filesystem->open(filePath(name, ".m").c_str(), "r");
+    if (!file) {
+        return nullptr;
+    }
+    auto entry = std::make_shared<Entry>();
+    if (!readCacheMetadata(file, entry.get()) || entry->url != url) {
+        return nullptr;
+    }
+    entry->file = filePath(name, ".b");
+
+    file_entries.splice(file_entries.begin(), file_entries, it->second);
+    return entry;
+}
+
+
+void AsyncHTTPRequest::Cache::evictFiles(size_t needed) {
+    while (!file_entries.empty() && current_file_size + needed > max_file_size) {
+        TRACE_FOR(0, CACHE_EVICT_FILE, file_entries.back().size, 0);
+        removeFile(file_entries.back().name);
+    }
+}
+
+
+void AsyncHTTPRequest::Cache::removeFile(const std::string& name) {
+    auto it = file_index.find(name);
+    if (it == file_index.end()) {
+        return;
+    }
+    filesystem->remove(filePath(name, ".m").c_str());
+    filesystem->remove(filePath(name, ".b").c_str());
+    current_file_size -= it->second->size;
+    file_entries.erase(it->second);
+    file_index.erase(it);
+}
+
+
+fs::File AsyncHTTPRequest::Cache::beginFile(const std::string& url) {
+    auto lock = Lock(mutex);
+
+    if (filesystem == nullptr) {
+        return fs::File();
+    }
+    loadFileIndex();
+
+    auto name = fileName(url);
+    if (files_recording.count(name) > 0) {
+        // Another request is already writing this response.
+        return fs::File();
+    }
+
+    auto file = filesystem->open(filePath(name, ".t").c_str(), "w");
+    if (file) {
+        files_recording.insert(name);
+    }
+    return file;
+}
+
+
+void AsyncHTTPRequest::Cache::commitFile(const Entry& entry, fs::File& file) {
+    auto length = file.size();
+    file.close();
+
+    auto lock = Lock(mutex);
+
+    auto name = fileName(entry.url);
+    files_recording.erase(name);
+    removeFile(name);
+
+    auto size = entry.size() - entry.body.size() + length;
+    if (size > max_file_size) {
+        filesystem->remove(filePath(name, ".t").c_str());
+        return;
+    }
+    evictFiles(size);
+
+    auto metadata = filesystem->open(filePath(name, ".m").c_str(), "w");
+    if (!metadata || !filesystem->rename(filePath(name, ".t").c_str(), filePath(name, ".b").c_str())) {
+        TRACE_FOR(0, CACHE_FILE_FAILED, size, 0);
+        metadata.close();
+        filesystem->remove(filePath(name, ".m").c_str());
+        filesystem->remove(filePath(name, ".t").c_str());
+        return;
+    }
+    metadata.print(entry.url.c_str());
+    metadata.print("\n");
+    metadata.print(entry.status);
+    metadata.print("\n");
+    metadata.print(entry.content_type.c_str());
+    metadata.print("\n");
+    metadata.print(entry.etag.c_str());
+    metadata.print("\n");
+    metadata.print(entry.last_modified.c_str());
+    metadata.print("\n");
+    metadata.print(static_cast<unsigned long>(length));
+    metadata.print("\n");
+    metadata.close();
+
+    file_entries.push_front(FileEntry{name, size});
+    file_index[name] = file_entries.begin();
+    current_file_size += size;
+}
+
+
+void AsyncHTTPRequest::Cache::abortFile(const std::string& url, fs::File& file) {
+    file.close();
+
+    auto lock = Lock(mutex);
+
+    auto name = fileName(url);
+    files_recording.erase(name);
+    filesystem->remove(filePath(name, ".t").c_str());
+}
+
+
+AsyncHTTPRequest::URL::URL(const char *url) {
+    const char *colon = strchr(url, ':');
+
+    if (colon == nullptr) {
+        scheme = url;
+        return;
+    }
+
+    scheme = std::string(url, colon - url);
+
+    auto rest = colon + 1;
+
+    if (rest[0] != '/' || rest[1] != '/') {
+        path = rest;
+        return;
+    }
+    else {
+        rest += 2;
+    }
+
+    const char* slash = strchr(rest, '/');
+    if (slash == nullptr) {
+        slash = rest + strlen(rest);
+    }
+    colon = strchr(rest, ':');
+    if (colon != nullptr && colon < slash) {
+        port = parseInteger(colon + 1);
+    }
+    else {
+        colon = slash;
+        if (scheme == "http") {
+            port = 80;
+        }
+        else if (scheme == "https") {
+            port = 443;
+        }
+    }
+
+    host = std::string(rest, colon - rest);
+    path = slash;
+}
+
+
+// Must be called with the lock held. Close the returned client with close_client() after releasing it.
+AsyncSSLClient* AsyncHTTPRequest::detach_client() {
+    auto old_client = client;
+    if (client != nullptr) {
         client = nullptr;
+        account_objects();
+    }
+    return old_client;
+}
+
+
+// Closing the connection can call its handlers, which take the lock. The client isn't deleted here: this may
+// run on another task while the network task still has events for it queued, so it is freed by its disconnect
+// callback, which AsyncTCP calls from close() or later on the network task.
+void AsyncHTTPRequest::close_client(AsyncSSLClient* client) {
+    if (client != nullptr) {
+        // Closing the connection ourselves is not a disconnect by the server.
+        client->onAck(nullptr);
+        client->onData(nullptr);
+        client->onError(nullptr);
+        client->onTimeout(nullptr);
+        client->onPoll(nullptr);
+        client->onConnect(closedClientConnect);
+        client->onDisconnect(closedClientDisconnect);
+        client->close();
+    }
+}
+
+
+// A host name lookup still running when the connection was closed ends in a connection nobody uses.
+void AsyncHTTPRequest::closedClientConnect(void* arg, AsyncSSLClient* client) {
+    (void)arg;
+    client->close();
+}
+
+
+void AsyncHTTPRequest::closedClientDisconnect(void* arg, AsyncSSLClient* client) {
+    (void)arg;
+    delete client;
+}
+
+
+void AsyncHTTPRequest::account_objects() {
+    size_t size = 0;
+
+    if (client != nullptr) {
+        size += sizeof(*client);
+    }
+    if (responseBody != nullptr) {
+        size += sizeof(*responseBody);
+    }
+    if (inflater != nullptr) {
+        size += inflater->memorySize();
+    }
+    if (deflater != nullptr) {
+        size += deflater->memorySize();
+    }
+    if (response_reader != nullptr) {
+        size += sizeof(*response_reader);
     }
+    for (auto string : {&lastErrorString, &request_method, &request_url, &response_content_type, &response_content_encoding, &response_etag, &response_last_modified, &cache_key, &resume_validator}) {
+        // Short strings are stored in the string object itself.
+        if (string->capacity() >= sizeof(std::string)) {
+            size += string->capacity() + 1;
+        }
+    }
+    size += responseContentType.length();
+
+    if (size > object_memory) {
+        memory_usage.allocated(size - object_memory);
+    }
+    else {
+        memory_usage.released(object_memory - size);
+    }
+    object_memory = size;
 }
 
 
+// Called without the lock held. Notifications are taken under the lock, so each is posted once even if
+// the network task and abort() post them at the same time.
 void AsyncHTTPRequest::post_notifications() {
-    if (notify_error) {
-        if (errorHandler != nullptr) {
-            DEBUG("Posting error notification.");
-            errorHandler(this, error());
+    auto lock = Lock(mutex);
+    auto error = notify_error;
+    auto begin = notify_begin && !error;
+    auto data = notify_data && !error;
+    auto complete = notify_complete && !error;
+    notify_error = false;
+    notify_begin = false;
+    notify_data = false;
+    notify_complete = false;
+    auto old_client = error || complete ? detach_client() : nullptr;
+    lock.unlock();
+
+    close_client(old_client);
+
+    if (error) {
+        // After this, the request may have been destroyed by a handler or coroutine.
+        post_notification(Executor::NOTIFY_ERROR);
+        return;
+    }
+
+    if (begin) {
+        post_notification(Executor::NOTIFY_BEGIN);
+    }
+
+    if (data) {
+        // Data handlers read everything available, so one queued call is enough.
+        if (receivedDataHandler != nullptr && !data_event_pending.exchange(true)) {
+            post_notification(Executor::NOTIFY_DATA);
+        }
+    }
+
+    if (complete) {
+        // After this, the request may have been destroyed by a handler or coroutine.
+        post_notification(Executor::NOTIFY_COMPLETE);
+        return;
+    }
+
+#ifdef HTTP_COROUTINES
+    resumeWaiters();
+#endif
+}
+
+
+void AsyncHTTPRequest::post_notification(Executor::Notification notification) {
+    if (executor != nullptr) {
+        executor->post(this, notification);
+    }
+    else {
+        dispatch(notification);
+    }
+}
+
+
+// Waiting coroutines are resumed after the completion or error handler, on the same task. Nothing is done with
+// the request after that, so the coroutine may destroy it, but the handler must not destroy a request a
+// coroutine waits for.
+void AsyncHTTPRequest::dispatch(Executor::Notification notification) {
+#ifdef HTTP_COROUTINES
+    if (notification == Executor::NOTIFY_COMPLETE || notification == Executor::NOTIFY_ERROR) {
+        auto id = trace_id;
+        auto waiters = takeWaiters();
+        callHandler(notification);
+        resumeWaiters(id, waiters);
+        return;
+    }
+#endif
+    callHandler(notification);
+}
+
+
+void AsyncHTTPRequest::callHandler(Executor::Notification notification) {
+    switch (notification) {
+        case Executor::NOTIFY_BEGIN:
+            if (beginResponseHandler != nullptr) {
+                TRACE(NOTIFICATION, notification, 0);
+                beginResponseHandler(this, status());
+            }
+            break;
+
+        case Executor::NOTIFY_DATA:
+            data_event_pending = false;
+            if (receivedDataHandler != nullptr) {
+                TRACE(NOTIFICATION, notification, 0);
+                receivedDataHandler(this);
+            }
+            break;
+
+        case Executor::NOTIFY_COMPLETE:
+            if (completionHandler != nullptr) {
+                TRACE(NOTIFICATION, notification, 0);
+                completionHandler(this);
+            }
+            break;
+
+        case Executor::NOTIFY_ERROR:
+            if (errorHandler != nullptr) {
+                TRACE(NOTIFICATION, notification, 0);
+                errorHandler(this, error());
+            }
+            break;
+    }
+}
+
+
+AsyncHTTPRequest::Executor::Executor(size_t queue_length, uint32_t stack_size, UBaseType_t priority) {
+    queue = xQueueCreate(queue_length, sizeof(Event));
+    if (queue == nullptr) {
+        TRACE_FOR(0, EXECUTOR_FAILED, 0, 0);
+        return;
+    }
+    if (xTaskCreate(run, "http_executor", stack_size, this, priority, &task) != pdPASS) {
+        TRACE_FOR(0, EXECUTOR_FAILED, 1, 0);
+        task = nullptr;
+    }
+}
+
+
+// The task is stopped by an event without request, after the events queued before it.
+AsyncHTTPRequest::Executor::~Executor() {
+    if (task != nullptr) {
+        stopping = xTaskGetCurrentTaskHandle();
+        auto event = Event{nullptr, NOTIFY_BEGIN};
+        xQueueSend(queue, &event, portMAX_DELAY);
+        // Other notifications of this task may wake it too.
+        while (!stopped) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
         }
-        notify_error = false;
-        notify_data = false;
-        notify_complete = false;
-        close_client();
+    }
+    if (queue != nullptr) {
+        vQueueDelete(queue);
+    }
+}
+
+
+// Without a task, handlers are called directly. On the executor's own task too, since a handler waiting
+// for room in its own queue would never get it.
+void AsyncHTTPRequest::Executor::post(AsyncHTTPRequest* request, Notification notification) {
+    if (task == nullptr || xTaskGetCurrentTaskHandle() == task) {
+        request->dispatch(notification);
         return;
     }
+    auto event = Event{request, notification};
+    xQueueSend(queue, &event, portMAX_DELAY);
+}
+
+
+void AsyncHTTPRequest::Executor::run(void* arg) {
+    auto executor = static_cast<Executor*>(arg);
+    Event event;
+
+    while (true) {
+        if (xQueueReceive(executor->queue, &event, portMAX_DELAY) == pdTRUE) {
+            if (event.request == nullptr) {
+                break;
+            }
+            event.request->dispatch(event.notification);
+        }
+    }
+
+    // The executor may be freed as soon as stopped is set.
+    auto stopping = executor->stopping;
+    executor->stopped = true;
+    xTaskNotifyGive(stopping);
+    vTaskDelete(nullptr);
+}
+
+
+// Created on first use, since FreeRTOS objects can't be created during static initialization.
+SemaphoreHandle_t AsyncHTTPRequest::TimerWheel::getMutex() {
+    auto current = mutex.load();
+    if (current == nullptr) {
+        auto created = xSemaphoreCreateMutex();
+        if (mutex.compare_exchange_strong(current, created)) {
+            current = created;
+        }
+        else {
+            vSemaphoreDelete(created);
+        }
+    }
+    return current;
+}
+
+
+void AsyncHTTPRequest::TimerWheel::arm(Entry* entry, uint32_t delay_ms) {
+    auto lock = Lock(getMutex());
+
+    if (timer == nullptr) {
+        timer = xTimerCreate("http_timeouts", pdMS_TO_TICKS(HTTP_TIMER_TICK_MS), pdTRUE, this, tick);
+        if (timer == nullptr) {
+            return;
+        }
+    }
+    if (entry->armed) {
+        unlink(entry);
+    }
+
+    entry->tick = current_tick + (delay_ms + HTTP_TIMER_TICK_MS - 1) / HTTP_TIMER_TICK_MS;
+    if (entry->tick == current_tick) {
+        entry->tick += 1;
+    }
+    auto& slot = slots[entry->tick % HTTP_TIMER_SLOTS];
+    entry->previous = nullptr;
+    entry->next = slot;
+    if (slot != nullptr) {
+        slot->previous = entry;
+    }
+    slot = entry;
+    entry->armed = true;
+
+    count += 1;
+    if (count == 1) {
+        xTimerStart(timer, 0);
+    }
+}
+
+
+void AsyncHTTPRequest::TimerWheel::cancel(Entry* entry, bool wait) {
+    auto lock = Lock(getMutex());
 
-    if (notify_data) {
-        if (receivedDataHandler != nullptr) {
-            DEBUG("Posting data notification.");
-            receivedDataHandler(this);
+    if (entry->armed) {
+        unlink(entry);
+    }
+    // Waiting on the timer task itself would never end; there the request is destroyed from its own handler.
+    if (wait && xTaskGetCurrentTaskHandle() != xTimerGetTimerDaemonTaskHandle()) {
+        while (firing == entry) {
+            lock.unlock();
+            vTaskDelay(1);
+            lock.lock();
         }
-        notify_data = false;
     }
+}
+
+
+void AsyncHTTPRequest::TimerWheel::unlink(Entry* entry) {
+    if (entry->previous != nullptr) {
+        entry->previous->next = entry->next;
+    }
+    else {
+        slots[entry->tick % HTTP_TIMER_SLOTS] = entry->next;
+    }
+    if (entry->next != nullptr) {
+        entry->next->previous = entry->previous;
+    }
+    entry->previous = entry->next = nullptr;
+    entry->armed = false;
+    count -= 1;
+}
+
+
+void AsyncHTTPRequest::TimerWheel::tick(TimerHandle_t timer) {
+    auto wheel = static_cast<TimerWheel*>(pvTimerGetTimerID(timer));
+    auto lock = Lock(wheel->getMutex());
 
-    if (notify_complete) {
-        if (completionHandler != nullptr) {
-            DEBUG("Posting completion notification.");
-            completionHandler(this);
+    wheel->current_tick += 1;
+    auto entry = wheel->slots[wheel->current_tick % HTTP_TIMER_SLOTS];
+    while (entry != nullptr) {
+        // Entries a full turn or more ahead stay in the slot.
+        if (entry->tick != wheel->current_tick) {
+            entry = entry->next;
+            continue;
         }
-        notify_complete = false;
-        close_client();
+        wheel->unlink(entry);
+        wheel->firing = entry;
+        lock.unlock();
+        entry->request->handleDeadline();
+        lock.lock();
+        wheel->firing = nullptr;
+        // The slot may have changed while unlocked.
+        entry = wheel->slots[wheel->current_tick % HTTP_TIMER_SLOTS];
+    }
+
+    if (wheel->count == 0) {
+        xTimerStop(timer, 0);
+    }
+}
+
+
+#ifdef HTTP_COROUTINES
+AsyncHTTPRequest::Waiters AsyncHTTPRequest::takeWaiters() {
+    auto lock = Lock(mutex);
+    Waiters waiters;
+
+    if (isComplete()) {
+        waiters.completion = completion_waiter;
+        completion_waiter = nullptr;
+    }
+    if (data_waiter && (isComplete() || (responseBody != nullptr && responseBody->available() >= data_waiter_threshold))) {
+        waiters.data = data_waiter;
+        data_waiter = nullptr;
+    }
+    return waiters;
+}
+
+
+// The handles are copied, so they can be resumed even if the first coroutine destroys the request.
+void AsyncHTTPRequest::resumeWaiters(uint16_t trace_id, Waiters waiters) {
+    if (waiters.data) {
+        TRACE(COROUTINE_RESUMED, 0, 0);
+        waiters.data.resume();
+    }
+    if (waiters.completion) {
+        TRACE(COROUTINE_RESUMED, 1, 0);
+        waiters.completion.resume();
+    }
+}
+
+
+bool AsyncHTTPRequest::CompletionAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    auto lock = Lock(request->mutex);
+
+    if (request->isComplete()) {
+        return false;
     }
+    request->completion_waiter = handle;
+    return true;
 }
 
 
+// Wait for a batch of data, but not for more than is wanted.
+size_t AsyncHTTPRequest::Reader::ReadAwaiter::threshold() const {
+    return length < reader->request->wakeup_low_water ? length : reader->request->wakeup_low_water;
+}
+
+
+bool AsyncHTTPRequest::Reader::ReadAwaiter::await_ready() {
+    return length == 0 || reader->request->isComplete() || static_cast<size_t>(reader->available()) >= threshold();
+}
+
+
+bool AsyncHTTPRequest::Reader::ReadAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    auto lock = Lock(reader->request->mutex);
+
+    if (await_ready()) {
+        return false;
+    }
+    reader->request->data_waiter = handle;
+    // The queue still holds the part of the current span that has been read.
+    reader->request->data_waiter_threshold = threshold() + (reader->span_buffered ? 0 : reader->span_used);
+    return true;
+}
+
+
+size_t AsyncHTTPRequest::Reader::ReadAwaiter::await_resume() {
+    size_t available = reader->available();
+    return reader->readBytes(buffer, available < length ? available : length);
+}
+#endif
+
+
 AsyncHTTPRequest::Lock::Lock(SemaphoreHandle_t mutex): mutex(mutex) {
     if (mutex == nullptr) {
-        DEBUG("Locking NULL mutex.");
+        TRACE_FOR(0, NULL_MUTEX, 0, 0);
     }
     else {
+        lock();
+    }
+}
+
+void AsyncHTTPRequest::Lock::lock() {
+    if (mutex != nullptr && !locked) {
         DEBUG_MUTEX("Locking mutex.");
         xSemaphoreTake(mutex, portMAX_DELAY);
         locked = true;
@@ -809,43 +2835,168 @@ AsyncHTTPRequest::Reader* AsyncHTTPRequest::responseReader() {
     auto lock = Lock(mutex);
 
     if (response_reader == nullptr) {
-        DEBUG("Creating reader.");
+        TRACE(READER_CREATED, 0, 0);
         response_reader = new Reader(this);
+        account_objects();
     }
     return response_reader;
 }
 
+int AsyncHTTPRequest::Reader::available() {
+    if (span_buffered) {
+        return span_length - span_used + request->cached_response_file.available();
+    }
+    else {
+        size_t n = 0;
+        if (request->acquireBody()) {
+            if (request->responseBody != nullptr) {
+                n += request->responseBody->available();
+            }
+            request->releaseBody();
+        }
+        if (request->state == COMPLETE && request->cached_response) {
+            if (request->cached_response_file) {
+                n += request->cached_response_file.available();
+            }
+            else {
+                n += request->cached_response->body.size() - request->cached_response_offset;
+            }
+        }
+        // The current span has not been consumed from the request yet.
+        return n - span_used;
+    }
+}
+
+
 int AsyncHTTPRequest::Reader::read() {
-    char c;
+    if (!fill(1, millis())) {
+        return -1;
+    }
+    return static_cast<uint8_t>(span[span_used++]);
+}
 
-    if (readBytes(&c, 1) == 0) {
+
+int AsyncHTTPRequest::Reader::peek() {
+    if (!fill(1, millis())) {
         return -1;
     }
-    return c;
+    return static_cast<uint8_t>(span[span_used]);
 }
 
+
 size_t AsyncHTTPRequest::Reader::readBytes(char* data, size_t length) {
+    auto start_time = millis();
     size_t filled = 0;
 
-    while (filled < length) {
-        auto lock = Lock(request->mutex);
-
-        if (request->responseBody != nullptr) {
-            filled += request->read_prelocked(data + filled, length - filled);
+    while (filled < length && fill(length - filled, start_time)) {
+        auto n = span_length - span_used;
+        if (n > length - filled) {
+            n = length - filled;
         }
+        memcpy(data + filled, span + span_used, n);
+        span_used += n;
+        filled += n;
+    }
 
-        if (filled < length) {
-            if (request->isComplete()) {
-                DEBUG("Reader read all data.");
-                break;
+    return filled;
+}
+
+
+const char* AsyncHTTPRequest::Reader::peekSpan(size_t* length) {
+    if (!fill(*length > 0 ? *length : 1, millis())) {
+        *length = 0;
+        return nullptr;
+    }
+    if (*length == 0 || *length > span_length - span_used) {
+        *length = span_length - span_used;
+    }
+    return span + span_used;
+}
+
+
+void AsyncHTTPRequest::Reader::commit(size_t length) {
+    span_used += length;
+}
+
+
+// Makes sure the current span has unread data, getting the next one and waiting for it if needed.
+bool AsyncHTTPRequest::Reader::fill(size_t wanted, unsigned long start_time) {
+    while (span_used == span_length) {
+        release();
+
+        auto complete = request->isComplete();
+
+        span_length = HTTP_BUFFER_FRAGMENT_SIZE;
+        span = request->peekBody(&span_length);
+        if (span != nullptr) {
+            return true;
+        }
+        if (complete && request->cached_response_file) {
+            span_length = request->cached_response_file.read(reinterpret_cast<uint8_t*>(buffer), sizeof(buffer));
+            if (span_length > 0) {
+                span = buffer;
+                span_buffered = true;
+                return true;
             }
+        }
+        if (complete) {
+            TRACE_FOR(request->trace_id, READER_END, 0, 0);
+            return false;
+        }
 
-            request->reader_task = xTaskGetCurrentTaskHandle();
-            lock.unlock();
-            DEBUG("Reader waiting for more data.");
-            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (!waitForData(wanted, start_time)) {
+            TRACE_FOR(request->trace_id, READER_TIMEOUT, wanted, 0);
+            return false;
         }
     }
 
-    return filled;
+    return true;
+}
+
+
+void AsyncHTTPRequest::Reader::release() {
+    // Consuming nothing still ends the peek.
+    if (span != nullptr && !span_buffered) {
+        request->consumeBody(span_used);
+    }
+    span = nullptr;
+    span_length = 0;
+    span_used = 0;
+    span_buffered = false;
+}
+
+
+// Returns false if no data arrived before the timeout.
+bool AsyncHTTPRequest::Reader::waitForData(size_t threshold, unsigned long start_time) {
+    // Wait until a batch is queued, but not for more than is needed. Waiting for nothing would never block.
+    if (threshold > request->wakeup_low_water) {
+        threshold = request->wakeup_low_water;
+    }
+    if (threshold == 0) {
+        threshold = 1;
+    }
+    request->reader_threshold = threshold;
+    // Register before checking again, so data arriving in between wakes us.
+    request->reader_task = xTaskGetCurrentTaskHandle();
+    size_t available = 0;
+    if (request->acquireBody()) {
+        if (request->responseBody != nullptr) {
+            available = request->responseBody->available();
+        }
+        request->releaseBody();
+    }
+    if (available >= threshold || request->isComplete()) {
+        request->reader_task = nullptr;
+        return true;
+    }
+
+    auto elapsed = millis() - start_time;
+    if (elapsed >= _timeout) {
+        request->reader_task = nullptr;
+        return false;
+    }
+    TRACE_FOR(request->trace_id, READER_WAITING, threshold, 0);
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(_timeout - elapsed));
+    // A timeout is noticed on the next call, after checking for data once more.
+    return true;
 }
@@ -31,10 +31,28 @@
 
 #define USE_SSL 1
 
+#include <atomic>
 #include <functional>
+#include <list>
+#include <memory>
+#include <new>
 #include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define HTTP_COROUTINES 1
+#include <coroutine>
+#include <exception>
+#endif
 
 #include <Arduino.h>
+#include <FS.h>
+#include <esp_partition.h>
+#include <freertos/timers.h>
 #if USE_SSL
 #include <AsyncTCP_SSL.hpp>
 #else
@@ -43,6 +61,20 @@ typedef AsyncClient AsyncSSLClient;
 #endif
 
 #define HTTP_BUFFER_FRAGMENT_SIZE 128 // 512
+#define HTTP_SINK_BLOCK_SIZE 4096
+#define HTTP_INFLATE_WINDOW_SIZE 32768
+#define HTTP_READ_AHEAD HTTP_BUFFER_FRAGMENT_SIZE
+#define HTTP_DEFLATE_WINDOW_SIZE 4096
+#define HTTP_DEFLATE_OUTPUT_SIZE 512
+#define HTTP_JSON_MAX_DEPTH 16
+#define HTTP_JSON_MAX_PATH 128
+#define HTTP_JSON_MAX_VALUE 256
+#define HTTP_DELEGATE_SIZE (4 * sizeof(void*))
+// Defined here so all translation units agree on it.
+//#define HTTP_TRACE
+#define HTTP_TRACE_SIZE 256 // records, a power of 2
+#define HTTP_TIMER_TICK_MS 100
+#define HTTP_TIMER_SLOTS 64
 
 class AsyncHTTPRequest {
 public:
@@ -52,16 +84,115 @@ public:
         ERROR_IN_USE,
         ERROR_CANNOT_CONNECT,
         ERROR_TIMEOUT,
-        ERROR_CONNECTION_CLOSED
+        ERROR_CONNECTION_CLOSED,
+        ERROR_CACHE,
+        ERROR_WRITE,
+        ERROR_DECODE,
+        ERROR_PROTOCOL,
+        ERROR_ABORTED
+    };
+
+    enum CompressionFormat {
+        FORMAT_RAW,
+        FORMAT_ZLIB,
+        FORMAT_GZIP,
+        FORMAT_DEFLATE // zlib or raw, both are sent for Content-Encoding: deflate
     };
 
+    // Like std::function, but stores the callable in place and never allocates.
+    // Callables larger than Size bytes (e.g. lambdas capturing too much) are rejected at compile time.
+    template <typename Signature, size_t Size = HTTP_DELEGATE_SIZE> class Delegate;
+
+    template <typename R, typename... Args, size_t Size> class Delegate<R(Args...), Size> {
+    public:
+        Delegate() = default;
+        Delegate(std::nullptr_t) {}
+        template <typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, Delegate>::value>::type>
+        Delegate(F&& f) { set(std::forward<F>(f)); }
+        Delegate(const Delegate& other) { copy(other); }
+        ~Delegate() { reset(); }
+
+        Delegate& operator=(const Delegate& other) { if (this != &other) { reset(); copy(other); } return *this; }
+        Delegate& operator=(std::nullptr_t) { reset(); return *this; }
+
+        R operator()(Args... args) const { return operations->invoke(storage, std::forward<Args>(args)...); }
+        explicit operator bool() const { return operations != nullptr; }
+        bool operator==(std::nullptr_t) const { return operations == nullptr; }
+        bool operator!=(std::nullptr_t) const { return operations != nullptr; }
+
+    private:
+        struct Operations {
+            R (*invoke)(void* storage, Args&&... args);
+            void (*copy)(void* storage, const void* other);
+            void (*destroy)(void* storage);
+        };
+
+        template <typename F> struct Implementation {
+            static R invoke(void* storage, Args&&... args) { return (*static_cast<F*>(storage))(std::forward<Args>(args)...); }
+            static void copy(void* storage, const void* other) { new (storage) F(*static_cast<const F*>(other)); }
+            static void destroy(void* storage) { static_cast<F*>(storage)->~F(); }
+        };
+
+        alignas(void*) mutable unsigned char storage[Size];
+        const Operations* operations = nullptr;
+
+        template <typename F> void set(F&& f) {
+            typedef typename std::decay<F>::type Callable;
+            static_assert(sizeof(Callable) <= Size, "callable too large for Delegate");
+            static_assert(alignof(Callable) <= alignof(void*), "callable alignment too large for Delegate");
+            static const Operations callable_operations = { Implementation<Callable>::invoke, Implementation<Callable>::copy, Implementation<Callable>::destroy };
+            new (storage) Callable(std::forward<F>(f));
+            operations = &callable_operations;
+        }
+        void copy(const Delegate& other) {
+            if (other.operations != nullptr) {
+                other.operations->copy(storage, other.storage);
+            }
+            operations = other.operations;
+        }
+        void reset() {
+            if (operations != nullptr) {
+                operations->destroy(storage);
+                operations = nullptr;
+            }
+        }
+    };
+
+    // Bytes allocated, currently and at most. Allocations are also counted in the parent, if any.
+    class MemoryUsage {
+    public:
+        explicit MemoryUsage(MemoryUsage* parent = nullptr): parent(parent) {}
+
+        size_t current() const { return current_bytes; }
+        size_t peak() const { return peak_bytes; }
+        void resetPeak() { peak_bytes = current_bytes.load(); }
+
+        void allocated(size_t length);
+        void released(size_t length);
+
+    private:
+        MemoryUsage* parent;
+        std::atomic<size_t> current_bytes{0};
+        std::atomic<size_t> peak_bytes{0};
+    };
+
+    // Memory used by all requests and buffers.
+    static MemoryUsage memory;
+
     class Buffer: public Print {
     public:
         Buffer() = default;
+        // Counts fragments in usage instead of memory.
+        explicit Buffer(MemoryUsage* usage): usage(usage) {}
         Buffer(const char* data, size_t length) { write(data, length); }
+        Buffer(const Buffer&) = delete;
+        Buffer& operator=(const Buffer&) = delete;
+        ~Buffer() { clear(); }
         size_t write(uint8_t c) { write(reinterpret_cast<const char*>(&c), 1); return 1; }
         void write(const char* data, size_t length);
         size_t read(char* data, size_t length);
+        // Reads a line into data without the line ending. Returns nullptr if there is no complete line of at most
+        // length bytes, including the line ending.
         char* readline(char* data, size_t length);
         void print(const char* string) { write(string, strlen(string)); }
         void print(String string) { write(string.c_str(), string.length()); }
@@ -79,51 +210,799 @@ public:
             char data[HTTP_BUFFER_FRAGMENT_SIZE];
             Fragment *next = nullptr;
         };
+        MemoryUsage* usage = &memory;
         size_t start = 0;
         size_t end = 0;
         Fragment *first = nullptr;
         Fragment *last = nullptr;
+
+        Fragment* newFragment();
+        void deleteFragment(Fragment* fragment);
     };
 
-    class Reader {
+    // Reads the response body as a Stream. Reading waits for data until the timeout set with setTimeout()
+    // (1000 ms by default) expires; read() and peek() return -1 at the end of the body or on timeout.
+    class Reader: public Stream {
     public:
         Reader(AsyncHTTPRequest* request): request(request) {}
 
-        int read();
-        size_t readBytes(char* buffer, size_t length);
+        // Number of bytes that can be read without waiting.
+        int available() override;
+        int read() override;
+        int peek() override;
+        size_t readBytes(char* buffer, size_t length) override;
+        using Stream::readBytes;
+        // The body can't be written.
+        size_t write(uint8_t c) override { (void)c; return 0; }
+        void flush() override {}
+
+        // Returns the next contiguous run of body data of at most *length bytes (as much as is available if *length
+        // is 0) and sets *length to its size, waiting until data is available. Returns nullptr at the end of the body or on timeout.
+        // The data stays valid until it is consumed with commit().
+        const char* peekSpan(size_t* length);
+        void commit(size_t length);
+
+#ifdef HTTP_COROUTINES
+        // Resumes the awaiting coroutine on the network task once data is available, then reads up to length
+        // bytes without waiting. Returns 0 at the end of the body. Once the request is complete, the coroutine is
+        // resumed like one awaiting completion.
+        class ReadAwaiter {
+        public:
+            ReadAwaiter(Reader* reader, char* buffer, size_t length): reader(reader), buffer(buffer), length(length) {}
+
+            bool await_ready();
+            bool await_suspend(std::coroutine_handle<> handle);
+            size_t await_resume();
+
+        private:
+            Reader* reader;
+            char* buffer;
+            size_t length;
+
+            size_t threshold() const;
+        };
+
+        ReadAwaiter readAsync(char* buffer, size_t length) { return ReadAwaiter(this, buffer, length); }
+#endif
 
     private:
         AsyncHTTPRequest* request;
+        // Current span, data before span_used is read but not yet consumed from the request.
+        const char* span = nullptr;
+        size_t span_length = 0;
+        size_t span_used = 0;
+        // Body read from a cache file, which has no spans of its own.
+        char buffer[HTTP_BUFFER_FRAGMENT_SIZE];
+        bool span_buffered = false;
+
+        bool fill(size_t wanted, unsigned long start_time);
+        void release();
+        bool waitForData(size_t threshold, unsigned long start_time);
+    };
+
+    // Receives the response body instead of the response buffer.
+    // It is called from the network task; data is acknowledged to the server only after write() returns,
+    // so a slow sink throttles the sender.
+    class Sink {
+    public:
+        virtual ~Sink() = default;
+
+        // Returns false on error, which aborts the request.
+        virtual bool write(const char* data, size_t length) = 0;
+        // Called after the whole body has been written.
+        virtual bool finish() { return true; }
+    };
+
+    // Collects the body into blocks of block_size bytes, aligned to the start of the body.
+    class BlockSink: public Sink {
+    public:
+        explicit BlockSink(size_t block_size = HTTP_SINK_BLOCK_SIZE): block_size(block_size) {}
+        ~BlockSink() { delete[] block; }
+
+        bool write(const char* data, size_t length) override;
+        bool finish() override;
+
+        size_t size() const { return offset + fill; }
+
+    protected:
+        // Write length bytes at offset. length is a multiple of block_size, except for the last block.
+        virtual bool writeBlocks(size_t offset, const char* data, size_t length) = 0;
+
+        size_t block_size;
+
+    private:
+        char* block = nullptr;
+        size_t fill = 0;
+        size_t offset = 0;
+    };
+
+    // Writes the body to a file, which is closed when the body is complete.
+    class FileSink: public BlockSink {
+    public:
+        explicit FileSink(fs::File file, size_t block_size = HTTP_SINK_BLOCK_SIZE): BlockSink(block_size), file(file) {}
+
+        bool finish() override;
+
+    protected:
+        bool writeBlocks(size_t offset, const char* data, size_t length) override;
+
+    private:
+        fs::File file;
+    };
+
+    // Writes the body to a flash partition, erasing it as needed. block_size is rounded up to a multiple of the sector size.
+    class PartitionSink: public BlockSink {
+    public:
+        explicit PartitionSink(const esp_partition_t* partition, size_t block_size = HTTP_SINK_BLOCK_SIZE);
+
+    protected:
+        bool writeBlocks(size_t offset, const char* data, size_t length) override;
+
+    private:
+        const esp_partition_t* partition;
+    };
+
+    // Decompresses a gzip, zlib or raw deflate stream and passes the result to output.
+    // Only the last window_size bytes of output are kept for back references (a power of 2, at most 32768);
+    // streams referring further back are rejected.
+    class Inflater: public Sink {
+    public:
+        Inflater(Sink* output, CompressionFormat format, size_t window_size = HTTP_INFLATE_WINDOW_SIZE);
+        ~Inflater();
+
+        bool write(const char* data, size_t length) override;
+        // Returns false if the stream is incomplete.
+        bool finish() override;
+
+        bool isComplete() const { return state == STATE_DONE; }
+        size_t totalOut() const { return position; }
+        // Bytes allocated, including the window.
+        size_t memorySize() const { return sizeof(*this) + window_mask + 1; }
+
+    private:
+        enum State {
+            STATE_ZLIB_HEADER,
+            STATE_DEFLATE_HEADER,
+            STATE_GZIP_HEADER,
+            STATE_GZIP_FIELD,
+            STATE_GZIP_EXTRA_LENGTH,
+            STATE_GZIP_SKIP,
+            STATE_GZIP_STRING,
+            STATE_BLOCK,
+            STATE_STORED_LENGTH,
+            STATE_STORED_COMPLEMENT,
+            STATE_STORED,
+            STATE_TABLE,
+            STATE_CODE_LENGTHS_CODE,
+            STATE_CODE_LENGTHS,
+            STATE_CODES,
+            STATE_LENGTH_EXTRA,
+            STATE_DISTANCE,
+            STATE_DISTANCE_EXTRA,
+            STATE_TRAILER,
+            STATE_DONE,
+            STATE_FAILED
+        };
+
+        struct Huffman {
+            uint16_t count[16];
+            uint16_t symbol[288];
+        };
+
+        Sink* output;
+        CompressionFormat format;
+        State state;
+        char* window;
+        size_t window_mask;
+        size_t position = 0; // total bytes of output
+        size_t flushed = 0; // bytes of output passed on
+        uint32_t checksum;
+        bool output_failed = false;
+
+        const char* in = nullptr;
+        const char* in_end = nullptr;
+        uint32_t bit_buffer = 0;
+        unsigned int bit_count = 0;
+
+        bool last_block = false;
+        uint8_t gzip_flags = 0;
+        size_t counter = 0;
+        size_t length = 0;
+        size_t code_count = 0;
+        size_t distance_count = 0;
+        int symbol = -1;
+        uint8_t header[10];
+        uint8_t lengths[320];
+        Huffman literal_code;
+        Huffman distance_code;
+
+        bool need(unsigned int n);
+        uint32_t bits(unsigned int n);
+        int decode(const Huffman* code);
+        static bool build(Huffman* code, const uint8_t* lengths, size_t n, bool complete = false);
+        void put(char c);
+        bool flush();
+        void fail() { state = STATE_FAILED; }
+        void nextGzipField();
+        void endOfBlock();
+        bool checkTrailer();
+    };
+
+    // Compresses data with fixed Huffman codes, finding matches in the last window_size bytes (at most 16384).
+    // FORMAT_DEFLATE produces zlib format. Output is passed on in pieces of HTTP_DEFLATE_OUTPUT_SIZE bytes.
+    class Deflater: public Sink {
+    public:
+        Deflater(Sink* output, CompressionFormat format, size_t window_size = HTTP_DEFLATE_WINDOW_SIZE);
+        ~Deflater();
+
+        bool write(const char* data, size_t length) override;
+        // Ends the stream and passes on all remaining output.
+        bool finish() override;
+
+        // Bytes allocated, including window and hash table.
+        size_t memorySize() const;
+
+    private:
+        Sink* output;
+        CompressionFormat format;
+        size_t window_size;
+        char* buffer; // twice window_size: history and lookahead
+        uint16_t* hash_table; // position + 1 of last occurrence of hashed 3 bytes, 0 if none
+        size_t start = 0; // next position to compress
+        size_t end = 0;
+        bool started = false;
+        bool failed = false;
+        uint32_t checksum;
+        size_t total_in = 0;
+
+        uint32_t bit_buffer = 0;
+        unsigned int bit_count = 0;
+        char out[HTTP_DEFLATE_OUTPUT_SIZE];
+        size_t out_length = 0;
+
+        void begin();
+        void compress(bool finishing);
+        void slide();
+        void putBits(uint32_t value, unsigned int n);
+        void putCode(uint32_t code, unsigned int n);
+        void putLiteral(uint8_t c);
+        void putMatch(size_t length, size_t distance);
+        void putByte(uint8_t c);
+        void flushOutput();
+    };
+
+    // Parses a JSON body as it arrives and calls handler for each value, without keeping the document.
+    // path is a JSON pointer (RFC 6901) to the value, e.g. "/items/0/name", "" for the top level value.
+    // value is the text of numbers and literals, the unescaped contents of strings, and empty for containers.
+    // Documents nested deeper than max_depth, or with longer paths or values, are rejected.
+    class JSONSink: public Sink {
+    public:
+        enum Type {
+            OBJECT_BEGIN,
+            OBJECT_END,
+            ARRAY_BEGIN,
+            ARRAY_END,
+            STRING,
+            NUMBER,
+            BOOLEAN,
+            NULL_VALUE
+        };
+        typedef Delegate<void(Type type, const char* path, const char* value, size_t length)> Handler;
+
+        JSONSink(Handler handler, size_t max_depth = HTTP_JSON_MAX_DEPTH, size_t max_path = HTTP_JSON_MAX_PATH, size_t max_value = HTTP_JSON_MAX_VALUE);
+
+        bool write(const char* data, size_t length) override;
+        // Returns false unless a complete document was parsed.
+        bool finish() override;
+
+    private:
+        enum State {
+            STATE_VALUE,
+            STATE_KEY,
+            STATE_COLON,
+            STATE_AFTER_VALUE,
+            STATE_STRING,
+            STATE_ESCAPE,
+            STATE_UNICODE,
+            STATE_NUMBER,
+            STATE_LITERAL,
+            STATE_DONE,
+            STATE_ERROR
+        };
+
+        struct Level {
+            bool array;
+            size_t index; // of current array element
+            size_t path_length; // of the container itself
+        };
+
+        Handler handler;
+        size_t max_depth;
+        size_t max_path;
+        size_t max_value;
+        State state = STATE_VALUE;
+        bool container_start = false; // the container may be closed without a value
+        bool in_key = false;
+        std::vector<Level> levels;
+        std::string path;
+        std::string value;
+        uint32_t code_point = 0;
+        uint32_t high_surrogate = 0;
+        int unicode_digits = 0;
+
+        bool process(char c);
+        bool beginValue(char c);
+        bool endString();
+        bool endScalar();
+        bool closeContainer(char c);
+        void endValue();
+        bool append(char c);
+        bool appendCodePoint(uint32_t code_point);
+        void emit(Type type) { handler(type, path.c_str(), value.data(), value.size()); }
+    };
+
+    // Downloads a resource over several connections in parallel, each fetching a range of range_size bytes.
+    // The ranges are written to sink in order; ranges received ahead of that are buffered in memory, at most
+    // (connections - 1) * range_size bytes, since a response longer than its range fails the download.
+    // If the server doesn't report the size of the resource, ranges are fetched one at a time until a short one arrives.
+    class ParallelDownload {
+    public:
+        typedef Delegate<void(ParallelDownload* download, Error error)> CompletionHandler;
+
+        ParallelDownload(Sink* sink, size_t connections = 4, size_t range_size = 32 * 1024);
+        ~ParallelDownload();
+
+        Error start(const char* url);
+
+        // Called on a background thread when the download is complete or has failed.
+        void onCompletion(CompletionHandler handler) { completionHandler = handler; }
+
+        bool isComplete() const { return complete; }
+        Error error() const { return current_error; }
+        // Status of first response, or of the response that made the download fail.
+        int status() const { return http_status; }
+        // Size of the resource, if the server reported it or once the download is complete.
+        size_t contentLength() const { return total_length; }
+
+    private:
+        class Part: public Sink {
+        public:
+            Part(ParallelDownload* download, size_t offset, size_t length): download(download), offset(offset), length(length) {}
+
+            bool write(const char* data, size_t length) override { return download->writePart(this, data, length); }
+
+            ParallelDownload* download;
+            size_t offset;
+            size_t length;
+            AsyncHTTPRequest* request = nullptr;
+            Buffer data; // Received ahead of previous parts.
+            size_t received = 0;
+            bool complete = false;
+        };
+
+        SemaphoreHandle_t mutex = nullptr;
+        Sink* sink;
+        size_t connections;
+        size_t range_size;
+        std::string url;
+        std::string validator;
+        bool started = false;
+        int http_status = 0;
+        bool have_length = false;
+        bool sequential = false; // ranges supported, but length unknown
+        bool at_end = false;
+        size_t total_length = 0;
+        size_t next_offset = 0;
+        std::list<Part*> parts; // ordered by offset, first one is written to sink directly
+        std::list<AsyncHTTPRequest*> retired_requests;
+        std::list<Part*> aborted_parts; // still running when the download failed
+        bool complete = false;
+        bool notify_complete = false;
+        Error current_error = ERROR_OK;
+        CompletionHandler completionHandler = nullptr;
+
+        Error startPart(size_t offset, size_t length);
+        bool validStatus(const Part* part, int status) const;
+        void partResponse(Part* part, int status);
+        bool writePart(Part* part, const char* data, size_t length);
+        void partCompleted(Part* part);
+        void partFailed(Part* part, Error error);
+        bool flushPart(Part* part);
+        void schedule();
+        void finish(Error error);
+        void retireRequests();
+        void post_notifications();
+    };
+
+    // Cache for responses to GET requests, shared between requests.
+    // Its size is bounded, least recently used entries are evicted first.
+    // Cached responses are always revalidated with If-None-Match / If-Modified-Since.
+    class Cache {
+    public:
+        class Entry {
+        public:
+            std::string url;
+            int status = 0;
+            std::string content_type;
+            std::string etag;
+            std::string last_modified;
+            std::string body;
+            std::string file; // If set, body is stored in this file.
+            size_t file_length = 0;
+
+            size_t length() const { return file.empty() ? body.size() : file_length; }
+            size_t size() const { return url.size() + content_type.size() + etag.size() + last_modified.size() + body.size(); }
+        };
+
+        explicit Cache(size_t max_size);
+        ~Cache();
+
+        // Also keep responses in directory on filesystem, using at most max_size bytes.
+        // Responses are written to the filesystem while they are received and survive a reboot.
+        void useFilesystem(fs::FS* filesystem, const char* directory, size_t max_size);
+
+        std::shared_ptr<const Entry> lookup(const std::string& url);
+        void store(std::shared_ptr<const Entry> entry);
+        void remove(const std::string& url);
+        void clear();
+
+        size_t size() const { return current_size; }
+        size_t maxSize() const { return max_size; }
+        size_t filesystemSize() const { return current_file_size; }
+
+    private:
+        friend class AsyncHTTPRequest;
+
+        typedef std::list<std::shared_ptr<const Entry>> EntryList;
+
+        struct FileEntry {
+            std::string name;
+            size_t size;
+        };
+        typedef std::list<FileEntry> FileEntryList;
+
+        SemaphoreHandle_t mutex = nullptr;
+        size_t max_size;
+        size_t current_size = 0;
+        EntryList entries; // most recently used first
+        std::unordered_map<std::string, EntryList::iterator> index;
+
+        fs::FS* filesystem = nullptr;
+        std::string directory;
+        size_t max_file_size = 0;
+        size_t current_file_size = 0;
+        bool file_index_loaded = false;
+        FileEntryList file_entries; // most recently used first
+        std::unordered_map<std::string, FileEntryList::iterator> file_index;
+        std::unordered_set<std::string> files_recording;
+
+        void evict(size_t needed);
+        void remove_prelocked(const std::string& url);
+
+        std::string fileName(const std::string& url) const;
+        std::string filePath(const std::string& name, const char* extension) const;
+        void loadFileIndex();
+        std::shared_ptr<const Entry> lookupFile(const std::string& url);
+        void evictFiles(size_t needed);
+        void removeFile(const std::string& name);
+
+        // Used by requests to write responses through to the filesystem.
+        fs::File beginFile(const std::string& url);
+        void commitFile(const Entry& entry, fs::File& file);
+        void abortFile(const std::string& url, fs::File& file);
     };
 
-    typedef std::function<void(AsyncHTTPRequest* request, int status)> BeginResponseHandler;
-    typedef std::function<void(AsyncHTTPRequest* request)> CompletionHandler;
-    typedef std::function<void(AsyncHTTPRequest* request)> DataHandler;
-    typedef std::function<void(AsyncHTTPRequest* request, Error error)> ErrorHandler;
+    // Calls handlers of requests on its own task instead of the network task, so slow handlers don't stall
+    // network I/O. Up to queue_length events are queued; the network task waits while the queue is full.
+    // Events posted by a handler running on the executor are handled right away instead.
+    // The executor must outlive its requests, and a request must not be destroyed before its completion
+    // or error handler has been called. Destroying it waits for the running handler to return, so it must
+    // not be destroyed by one of its own handlers.
+    class Executor {
+    public:
+        Executor(size_t queue_length = 16, uint32_t stack_size = 4096, UBaseType_t priority = 1);
+        ~Executor();
+
+        bool isValid() const { return task != nullptr; }
+
+    private:
+        enum Notification {
+            NOTIFY_BEGIN,
+            NOTIFY_DATA,
+            NOTIFY_COMPLETE,
+            NOTIFY_ERROR
+        };
+
+        struct Event {
+            AsyncHTTPRequest* request;
+            Notification notification;
+        };
+
+        QueueHandle_t queue = nullptr;
+        TaskHandle_t task = nullptr;
+        TaskHandle_t stopping = nullptr;
+        std::atomic<bool> stopped{false};
+
+        void post(AsyncHTTPRequest* request, Notification notification);
+        static void run(void* arg);
+
+        friend class AsyncHTTPRequest;
+    };
+
+    // Times (from micros()) at which the request reached each stage, 0 if it hasn't (yet).
+    // AsyncTCP reports the connection only once it is established, so connected includes DNS lookup and TLS handshake.
+    struct Timing {
+        uint32_t started = 0; // send() was called
+        uint32_t connected = 0;
+        uint32_t sending = 0; // started sending the request
+        uint32_t sent = 0; // request including body was sent
+        uint32_t status_received = 0;
+        uint32_t headers_received = 0;
+        uint32_t body_started = 0; // first body data received
+        uint32_t finished = 0; // request completed or failed
+    };
+
+    // Counters and histograms aggregated over all requests, updated without locking.
+    // Read them with get(), or export a snapshot with exportBinary() or exportPrometheus().
+    class Metrics {
+    public:
+        enum Counter {
+            REQUESTS_STARTED,
+            REQUESTS_COMPLETED,
+            REQUESTS_FAILED,
+            CONNECTIONS, // connections established, including TLS handshake
+            RESUMES,
+            CACHE_HITS,
+            BYTES_SENT,
+            BYTES_RECEIVED,
+            ACKS_DELAYED,
+            COUNTER_COUNT
+        };
+
+        enum Gauge {
+            BUFFER_HIGH_WATER, // most bytes queued for a reader
+            GAUGE_COUNT
+        };
 
-    AsyncHTTPRequest() = default;
+        // Durations in milliseconds, measured from send().
+        enum Histogram {
+            CONNECT_TIME,
+            FIRST_BYTE_TIME, // until the status line was received
+            DURATION, // until the request completed or failed
+            HISTOGRAM_COUNT
+        };
+
+        static const size_t BUCKET_COUNT = 11; // the last one has no upper bound
+        static const uint32_t bucket_bounds[BUCKET_COUNT - 1];
+        static const size_t ERROR_COUNT = 16;
+
+        uint32_t get(Counter counter) const { return counters[counter]; }
+        uint32_t get(Gauge gauge) const { return gauges[gauge]; }
+        // Failed requests by error.
+        uint32_t failures(Error error) const { return error < ERROR_COUNT ? errors[error].load() : 0; }
+        uint32_t bucket(Histogram histogram, size_t index) const { return histograms[histogram].buckets[index]; }
+        uint32_t sum(Histogram histogram) const { return histograms[histogram].sum; }
+
+        // Writes all values as little endian 32 bit integers after a 4 byte header, returns bytes written
+        // or 0 if length is too small.
+        size_t exportBinary(uint8_t* data, size_t length) const;
+        static size_t binarySize();
+        // Writes all values in Prometheus text exposition format.
+        void exportPrometheus(Print& output) const;
+        void reset();
+
+    private:
+        struct HistogramData {
+            std::atomic<uint32_t> buckets[BUCKET_COUNT];
+            std::atomic<uint32_t> sum;
+        };
+
+        std::atomic<uint32_t> counters[COUNTER_COUNT] = {};
+        std::atomic<uint32_t> gauges[GAUGE_COUNT] = {};
+        std::atomic<uint32_t> errors[ERROR_COUNT] = {};
+        HistogramData histograms[HISTOGRAM_COUNT] = {};
+
+        void count(Counter counter, uint32_t n = 1) { counters[counter].fetch_add(n, std::memory_order_relaxed); }
+        void maximum(Gauge gauge, uint32_t value);
+        void observe(Histogram histogram, uint32_t value);
+        void failed(Error error);
+        void finished(const Timing& timing);
+
+        friend class AsyncHTTPRequest;
+    };
+
+    static Metrics metrics;
+
+    // Records what requests do in a ring buffer of the last HTTP_TRACE_SIZE events if HTTP_TRACE is defined.
+    // Defining DEBUG_HTTP prints them to Serial as they happen.
+    // Decode dumps with extras/decode_trace.py. Events are numbered in order, add new ones at the end.
+    class Trace {
+    public:
+        enum Event {
+            NONE,
+            CONNECTING, // request size, port
+            RESUMING, // offset, attempt
+            TCP_ACK, // length, time
+            TCP_CONNECTED,
+            TCP_DATA, // length, state
+            TCP_DISCONNECTED, // state
+            TCP_ERROR, // client error
+            TCP_TIMEOUT, // time
+            COMPLETED_BY_DISCONNECT,
+            CLOSED_PREMATURELY, // state
+            REQUEST_ERROR, // error, state
+            STATUS, // HTTP status
+            HEADER_LINE, // length
+            END_OF_HEADERS, // HTTP status
+            CANNOT_RESUME, // HTTP status, content range start
+            NOT_MODIFIED,
+            CONTENT_LENGTH, // length
+            CONTENT_TYPE, // length
+            CHUNKED,
+            BODY_DATA, // length
+            ACK_DELAYED, // length, bytes queued
+            ACK_SENT, // length
+            READER_WOKEN,
+            REQUEST_COMPLETE, // body length
+            CACHE_TOO_LARGE, // response size
+            CACHE_WRITE_FAILED,
+            CACHE_STORE, // response size
+            SENDING, // space
+            SENDING_BODY, // body size
+            RECEIVING_RESPONSE,
+            PARTITION_FULL, // offset, length
+            PART_START, // offset, length
+            PART_BAD_STATUS, // HTTP status, offset
+            RANGES_UNSUPPORTED,
+            PART_BAD_RANGE, // HTTP status, offset
+            CACHE_EVICT, // size
+            CACHE_DIRECTORY_FAILED,
+            CACHE_EVICT_FILE, // size
+            CACHE_FILE_FAILED, // size
+            NOTIFICATION, // Executor notification
+            EXECUTOR_FAILED, // 0: queue, 1: task
+            COROUTINE_RESUMED, // 0: reader, 1: completion
+            NULL_MUTEX,
+            READER_CREATED,
+            READER_END,
+            READER_TIMEOUT,
+            READER_WAITING, // bytes wanted
+            EVENT_COUNT
+        };
+
+        struct Record {
+            uint32_t time; // micros()
+            uint16_t event;
+            uint16_t request;
+            int32_t arg1;
+            int32_t arg2;
+        };
+
+        // Adds a record and prints it to echo, if given. Does nothing if HTTP_TRACE is not defined.
+        static void record(uint16_t request, Event event, int32_t arg1 = 0, int32_t arg2 = 0, Print* echo = nullptr);
+        // Writes "HTRC", version, record size, record count (uint16) and the records, oldest first, little endian.
+        // Records added while dumping may be garbled.
+        static void dump(Print& output);
+        // Writes the records as text, oldest first.
+        static void print(Print& output);
+        static void clear();
+
+        static const char* name(Event event);
+        static uint16_t newRequestId();
+
+    private:
+        static void print(Print& output, const Record& record);
+    };
+
+    typedef Delegate<void(AsyncHTTPRequest* request, int status)> BeginResponseHandler;
+    typedef Delegate<void(AsyncHTTPRequest* request)> CompletionHandler;
+    typedef Delegate<void(AsyncHTTPRequest* request)> DataHandler;
+    typedef Delegate<void(AsyncHTTPRequest* request, Error error)> ErrorHandler;
+
+    AsyncHTTPRequest() { memory_usage.allocated(sizeof(*this)); }
     ~AsyncHTTPRequest();
 
     Error send(const char* method, const char* url, const char* content_type, Buffer* body);
-    Error get(const char* url) { send("GET", url, nullptr, nullptr); }
-    Error post(const char* url, const char* content_type, Buffer* body) { send("POST", url, content_type, body); }
+    Error get(const char* url) { return send("GET", url, nullptr, nullptr); }
+    Error post(const char* url, const char* content_type, Buffer* body) { return send("POST", url, content_type, body); }
 
+    // Closes the connection, frees the request's buffers and fails it with ERROR_ABORTED, waking a waiting reader.
+    // Does nothing if the request is not running. Body data not read yet is freed too, unless the reader is using
+    // it right then or holds a span from peekBody(), in which case its next read frees it.
     void abort();
 
-    // These handlers will be called on a background thread.
+#ifdef HTTP_COROUTINES
+    // Coroutine that is started when called and not awaited itself, e.g.
+    //     AsyncHTTPRequest::Task fetch() { auto error = co_await request.getAsync(url); ... }
+    struct Task {
+        struct promise_type {
+            Task get_return_object() { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+    };
+
+    // Resumes the awaiting coroutine when the request completes or fails, returns error(). It is resumed after the
+    // completion or error handler, on the same task. The request must have been sent. The coroutine may destroy
+    // the request once resumed, the handlers must not.
+    class CompletionAwaiter {
+    public:
+        explicit CompletionAwaiter(AsyncHTTPRequest* request): request(request) {}
+
+        bool await_ready() const { return request->isComplete(); }
+        bool await_suspend(std::coroutine_handle<> handle);
+        Error await_resume() const { return request->error(); }
+
+    private:
+        AsyncHTTPRequest* request;
+    };
+
+    // Send the request and wait for it to complete. The body is kept in memory unless it is read while waiting
+    // (from another coroutine using Reader::readAsync()) or passed to a sink.
+    CompletionAwaiter sendAsync(const char* method, const char* url, const char* content_type, Buffer* body) { send(method, url, content_type, body); return CompletionAwaiter(this); }
+    CompletionAwaiter getAsync(const char* url) { return sendAsync("GET", url, nullptr, nullptr); }
+    CompletionAwaiter postAsync(const char* url, const char* content_type, Buffer* body) { return sendAsync("POST", url, content_type, body); }
+    CompletionAwaiter completion() { return CompletionAwaiter(this); }
+#endif
+
+    // These handlers will be called on a background thread: the network task, or the executor's task if one is set.
+    // Use executor for handlers of this request. Must be called before send().
+    void setExecutor(Executor* executor) { this->executor = executor; }
     void onBeginResponse(BeginResponseHandler handler) { beginResponseHandler = handler; }
     void onCompletion(CompletionHandler handler) {completionHandler = handler; }
     void onError(ErrorHandler handler) { errorHandler = handler; }
     void onReceivedData(DataHandler handler) { receivedDataHandler = handler; }
 
+    // Batch wake-ups of the reader and calls of the data handler: they happen once low_water bytes are queued
+    // (or as many as the reader is waiting for), or, for the data handler, when max_delay_ms have passed since
+    // the last call and new data arrives. ACKs are delayed while high_water or more bytes are queued;
+    // low_water is limited to high_water so the reader is woken before the server has to stop.
+    void setWakeup(size_t low_water, size_t high_water = HTTP_READ_AHEAD, uint32_t max_delay_ms = 0);
+    // Fail the request with ERROR_TIMEOUT if connecting takes longer than connect_ms, the response headers haven't
+    // been received headers_ms after connecting started, no data was received for idle_ms (not counting while
+    // ACKs are delayed for the reader), or the request takes longer than total_ms. 0 disables a timeout.
+    // They are checked every HTTP_TIMER_TICK_MS, and an expired one fails the request and frees its body right away,
+    // even while the host name is looked up. The error handler is called on the network task at the connection's
+    // next poll (every 500 ms with AsyncTCP), or when a lookup still running ends. Must be called before send().
+    void setTimeouts(uint32_t connect_ms, uint32_t headers_ms, uint32_t idle_ms, uint32_t total_ms = 0);
+
+    // Use cache for GET requests. Must be called before send(). A body served from the cache is written to the sink, if one is set.
+    void useCache(Cache* cache) { this->cache = cache; }
+    // Pass response body to sink instead of buffering it for read(). Must be called before send().
+    void setSink(Sink* sink) { this->sink = sink; }
+    // Send Accept-Encoding: gzip, deflate and decompress the response body, keeping window_size bytes of history.
+    // Must be called before send().
+    void acceptCompressed(size_t window_size = HTTP_INFLATE_WINDOW_SIZE) { inflate_window_size = window_size; }
+    // Compress the request body (FORMAT_GZIP or FORMAT_DEFLATE) while sending it, using chunked transfer encoding.
+    // Must be called before send().
+    void compressBody(CompressionFormat format) { compress_body = true; body_compression = format; }
+    // If the connection is lost while receiving the body, resume the download with a Range request, up to max_attempts times.
+    // The response must have a strong ETag or a Last-Modified header. Must be called before send().
+    void setResumable(int max_attempts) { max_resume_attempts = max_attempts; }
+    // Request only bytes first to last (inclusive) of the resource. Must be called before send().
+    void setRange(size_t first, size_t last) { haveRange = true; rangeFirst = first; rangeLast = last; }
+
     Reader* responseReader();
 
     bool isComplete() const { return state == ERROR || state == COMPLETE; }
     int status() const { return httpStatus; }
     const char* contentType() const { return state > RECEIVING_HEADERS ? response_content_type.c_str() : nullptr; }
+    // Content-Length of the response, or the length of the decoded body once complete. Content-Length is limited
+    // to 9 digits, so responses of 1 GB (10^9 bytes) or more fail with ERROR_PROTOCOL.
     size_t contentLength() const;
+    // Stable once the request is complete.
+    const Timing& timing() const { return timings; }
+    // Memory used by this request, including the request itself. Also counted in memory.
+    const MemoryUsage& memoryUsage() const { return memory_usage; }
+    // Identifies the request in Trace records.
+    uint16_t traceId() const { return trace_id; }
     Error error() const { return current_error; }
     const char* errorString() const { return lastErrorString.c_str(); }
+    // Response was not modified and is served from cache.
+    bool fromCache() const { return cached_response != nullptr; }
+    // Reads response body. The body must only be read by one task, either with read() or the reader.
     size_t read(char* data, size_t length);
 
 private:
@@ -139,6 +1018,74 @@ private:
         COMPLETE
     };
 
+    enum ChunkState {
+        CHUNK_SIZE_START,
+        CHUNK_SIZE,
+        CHUNK_EXTENSION,
+        CHUNK_DATA,
+        CHUNK_DATA_END,
+        CHUNK_TRAILER,
+        CHUNK_TRAILER_LINE
+    };
+
+    // Byte queue between one producer and one consumer task that needs no locking.
+    // Only the producer may call write(), only the consumer read().
+    class Queue {
+    public:
+        explicit Queue(MemoryUsage* usage): usage(usage), head(newFragment()), tail(head) {}
+        ~Queue();
+
+        void write(const char* data, size_t length);
+        size_t read(char* data, size_t length);
+
+        size_t available() const { return end - start; }
+
+        // Gets up to *length bytes without consuming them and sets *length to the number returned.
+        // (This only returns data from a single fragment.)
+        const char* peek(size_t* length);
+        void consume(size_t length) { read(nullptr, length); }
+
+    private:
+        struct Fragment {
+            char data[HTTP_BUFFER_FRAGMENT_SIZE];
+            Fragment* next = nullptr;
+        };
+
+        MemoryUsage* usage;
+        // The consumer keeps a fragment it has read completely until the producer has linked the next one.
+        Fragment* head;
+        size_t head_start = 0;
+        Fragment* tail;
+        size_t tail_start = 0;
+        std::atomic<size_t> start{0};
+        std::atomic<size_t> end{0};
+
+        Fragment* newFragment() { usage->allocated(sizeof(Fragment)); return new Fragment(); }
+        void deleteFragment(Fragment* fragment) { delete fragment; usage->released(sizeof(Fragment)); }
+    };
+
+    // Writes data as chunks to buffer.
+    class ChunkedBody: public Sink {
+    public:
+        explicit ChunkedBody(Buffer* buffer): buffer(buffer) {}
+
+        bool write(const char* data, size_t length) override;
+
+    private:
+        Buffer* buffer;
+    };
+
+    // Passes decoded body data to the request.
+    class DecodedBody: public Sink {
+    public:
+        explicit DecodedBody(AsyncHTTPRequest* request): request(request) {}
+
+        bool write(const char* data, size_t length) override { return request->deliverBodyData(data, length); }
+
+    private:
+        AsyncHTTPRequest* request;
+    };
+
     class URL {
     public:
         URL(const char* url);
@@ -149,11 +1096,46 @@ private:
         std::string path;
     };
 
+    // Calls handleDeadline() of requests from a single FreeRTOS timer that runs while any are armed.
+    // Entries are kept in slots by tick, so arming and cancelling take constant time.
+    class TimerWheel {
+    public:
+        struct Entry {
+            explicit Entry(AsyncHTTPRequest* request): request(request) {}
+
+            AsyncHTTPRequest* request;
+            Entry* previous = nullptr;
+            Entry* next = nullptr;
+            uint32_t tick = 0;
+            bool armed = false;
+        };
+
+        // Replaces an earlier arm of entry.
+        void arm(Entry* entry, uint32_t delay_ms);
+        // If wait is true, also waits until a running handleDeadline() of the entry's request returns.
+        void cancel(Entry* entry, bool wait = false);
+
+    private:
+        std::atomic<SemaphoreHandle_t> mutex{nullptr};
+        TimerHandle_t timer = nullptr;
+        Entry* slots[HTTP_TIMER_SLOTS] = {};
+        uint32_t current_tick = 0;
+        size_t count = 0;
+        Entry* firing = nullptr;
+
+        SemaphoreHandle_t getMutex();
+        void unlink(Entry* entry);
+        static void tick(TimerHandle_t timer);
+    };
+
+    static TimerWheel timer_wheel;
+
     class Lock {
     public:
         Lock(SemaphoreHandle_t mutex);
         ~Lock();
 
+        void lock();
         void unlock();
 
     private:
@@ -167,48 +1149,168 @@ private:
     DataHandler receivedDataHandler = nullptr;
 
     Reader* response_reader = nullptr;
+    Executor* executor = nullptr;
 
+    uint32_t connect_timeout = 0;
+    uint32_t headers_timeout = 0;
+    uint32_t idle_timeout = 0;
+    uint32_t total_timeout = 0;
+    uint32_t request_started = 0; // millis()
+    uint32_t connect_started = 0;
+    uint32_t last_activity = 0;
+    TimerWheel::Entry deadline_timer{this};
+    std::atomic<bool> data_event_pending{false};
+
+    // Protects everything except the response body queue, which is read without locking.
     SemaphoreHandle_t mutex = nullptr;
-    TaskHandle_t reader_task = nullptr;
+    std::atomic<TaskHandle_t> reader_task{nullptr};
+    std::atomic<size_t> reader_threshold{1}; // bytes the waiting reader needs
+    size_t wakeup_low_water = 1;
+    size_t wakeup_high_water = HTTP_READ_AHEAD;
+    uint32_t wakeup_max_delay = 0;
+    uint32_t last_data_notification = 0;
+
+    // Fragments are counted when allocated, other objects and strings by account_objects().
+    MemoryUsage memory_usage{&memory};
+    size_t object_memory = 0;
+    const uint16_t trace_id = Trace::newRequestId();
 
-    State state = EMPTY;
+    std::atomic<State> state{EMPTY};
+    Timing timings;
     Error current_error = ERROR_OK;
     int error_code = 0;
     std::string lastErrorString;
     AsyncSSLClient* client = nullptr;
 
-    Buffer buffer;
+    std::string request_method;
+    std::string request_url;
+    Buffer buffer{&memory_usage};
     Buffer* requestBody = nullptr;
+    bool compress_body = false;
+    CompressionFormat body_compression = FORMAT_GZIP;
+    Buffer compressedBody{&memory_usage};
+    ChunkedBody chunkedBody = ChunkedBody(&compressedBody);
+    Deflater* deflater = nullptr;
+    bool body_compressed = false;
 
     int httpStatus = 0;
     String responseContentType;
     bool chunkedResponse = false;
+    ChunkState chunkState = CHUNK_SIZE_START;
     size_t chunkSize = 0;
-    bool inChunkSize = false;
     size_t responseContentLength = 0;
-    size_t dataReceived = 0;
+    size_t dataReceived = 0; // body received, before decoding
+    size_t bodyReceived = 0; // body passed on, after decoding
     bool haveContentLength = false;
-    Buffer* responseBody = nullptr;
+    bool haveTransferEncoding = false;
+    Queue* responseBody = nullptr;
+    // The reader uses the queue without the lock, so the body of a request that was aborted or timed out is
+    // freed by whoever of the failing task and the reader finds it idle.
+    enum BodyAccess : uint8_t {
+        BODY_IDLE,
+        BODY_READING,
+        BODY_FREED
+    };
+    std::atomic<BodyAccess> body_access{BODY_IDLE};
+    bool body_peeked = false;
+    Sink* sink = nullptr;
+    size_t inflate_window_size = 0;
+    Inflater* inflater = nullptr;
+    DecodedBody decodedBody = DecodedBody(this);
     size_t unacknowledged_length = 0;
+    std::atomic<bool> delayed_ack{false};
 
     std::string response_content_type;
+    std::string response_content_encoding;
+    std::string response_etag;
+    std::string response_last_modified;
+    bool response_cacheable = true;
+
+    Cache* cache = nullptr;
+    std::string cache_key;
+    std::shared_ptr<const Cache::Entry> cache_candidate;
+    std::shared_ptr<Cache::Entry> cache_recording;
+    bool cache_recording_body = false;
+    fs::File cache_recording_file;
+    std::shared_ptr<const Cache::Entry> cached_response;
+    size_t cached_response_offset = 0;
+    fs::File cached_response_file;
 
+    int max_resume_attempts = 0;
+    int resume_attempts = 0;
+    int resume_status = 0;
+    size_t resume_offset = 0;
+    std::string resume_validator;
+    bool rangesSupported = true;
+    bool haveRange = false;
+    size_t rangeFirst = 0;
+    size_t rangeLast = 0;
+    size_t contentRangeStart = 0;
+    size_t contentRangeTotal = 0;
+
+    bool notify_begin = false;
     bool notify_data = false;
     bool notify_complete = false;
     bool notify_error = false;
 
-    size_t read_prelocked(char* data, size_t length);
+#ifdef HTTP_COROUTINES
+    std::coroutine_handle<> completion_waiter;
+    std::coroutine_handle<> data_waiter;
+    size_t data_waiter_threshold = 0;
+
+    struct Waiters {
+        std::coroutine_handle<> data;
+        std::coroutine_handle<> completion;
+    };
 
-    void parseHeader(const char* line);
+    Waiters takeWaiters();
+    void resumeWaiters() { resumeWaiters(trace_id, takeWaiters()); }
+    static void resumeWaiters(uint16_t trace_id, Waiters waiters);
+#endif
+
+    void parseHeader(char* line);
     static size_t parseInteger(const char* string);
     void parseStatusLine(const char* line);
     void processBodyData(char* data, size_t length);
     void processChunkedBodyData(char* data, size_t length);
+    void processBodyContent(const char* data, size_t length);
+    bool deliverBodyData(const char* data, size_t length);
+    void notifyDataAvailable();
+    bool bodyDiscarded() const { return state == ERROR && (current_error == ERROR_ABORTED || current_error == ERROR_TIMEOUT); }
+    bool acquireBody();
+    void releaseBody();
+    void freeDiscardedBody();
+    void freeBuffers();
+    const char* peekBody(size_t* length);
+    void consumeBody(size_t length);
+    void wakeReader();
+    void acknowledgeDelayed();
+    void armDeadline();
+    void cancelDeadline(bool wait = false);
+    uint32_t nextDeadline(uint32_t now, const char** expired) const;
+    void handleDeadline();
     void requestCompleted();
+    void serveFromCache();
     void sendData();
     bool sendData(Buffer* data);
 
-    void close_client();
+    bool connect(const char* content_type);
+    bool resumeDownload();
+    AsyncSSLClient* detach_client();
+    static void close_client(AsyncSSLClient* client);
+    void account_objects();
+
+    // Client callbacks, with the request as arg.
+    static void clientAck(void* arg, AsyncSSLClient* client, size_t length, uint32_t time);
+    static void clientConnect(void* arg, AsyncSSLClient* client);
+    static void clientData(void* arg, AsyncSSLClient* client, void* data, size_t length);
+    static void clientDisconnect(void* arg, AsyncSSLClient* client);
+    static void clientError(void* arg, AsyncSSLClient* client, int8_t error);
+    static void clientTimeout(void* arg, AsyncSSLClient* client, uint32_t time);
+    static void clientPoll(void* arg, AsyncSSLClient* client);
+    // Callbacks of a closed connection, without a request.
+    static void closedClientConnect(void* arg, AsyncSSLClient* client);
+    static void closedClientDisconnect(void* arg, AsyncSSLClient* client);
 
     void handleAck(size_t len, uint32_t time);
     void handleConnect();
@@ -217,8 +1319,15 @@ private:
     void handleError(int error);
     void handleError(Error new_error, const char* detail = nullptr);
     void handleTimeout(int timeout);
+    void handlePoll();
+
+    // Records the first time a stage is reached.
+    static void mark(uint32_t& time) { if (time == 0) { time = micros(); } }
 
     void post_notifications();
+    void post_notification(Executor::Notification notification);
+    void dispatch(Executor::Notification notification);
+    void callHandler(Executor::Notification notification);
 };
 
 
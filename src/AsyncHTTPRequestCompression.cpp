@@ -0,0 +1,915 @@
+/*
+ Copyright (C) Dieter Baron
+
+  This file is part of AsyncHTTPRequest, a library for making HTTP requests on ESP32.
+  The authors can be contacted at <dillo@nih.at>.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+  1. Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+  2. The names of the authors may not be used to endorse or promote
+     products derived from this software without specific prior
+     written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE AUTHORS ``AS IS'' AND ANY EXPRESS
+  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY
+  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+  GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+  IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+  IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "AsyncHTTPRequest.h"
+
+// Deflate format as described in RFC 1950 (zlib), RFC 1951 (deflate) and RFC 1952 (gzip).
+
+#define GZIP_FLAG_HCRC 0x02
+#define GZIP_FLAG_EXTRA 0x04
+#define GZIP_FLAG_NAME 0x08
+#define GZIP_FLAG_COMMENT 0x10
+
+static const uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t distance_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t distance_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+static const uint8_t code_length_order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+
+static uint32_t crc32(uint32_t crc, const char* data, size_t length) {
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+    };
+
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= static_cast<uint8_t>(data[i]);
+        crc = (crc >> 4) ^ table[crc & 0x0f];
+        crc = (crc >> 4) ^ table[crc & 0x0f];
+    }
+    return ~crc;
+}
+
+
+static uint32_t adler32(uint32_t adler, const char* data, size_t length) {
+    uint32_t a = adler & 0xffff;
+    uint32_t b = adler >> 16;
+
+    while (length > 0) {
+        // Largest n so that b doesn't overflow before reducing.
+        size_t n = length < 5552 ? length : 5552;
+        length -= n;
+        while (n-- > 0) {
+            a += static_cast<uint8_t>(*data++);
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+
+AsyncHTTPRequest::Inflater::Inflater(Sink* output, CompressionFormat format, size_t window_size): output(output), format(format) {
+    size_t size = 256;
+    while (size < window_size && size < 32768) {
+        size *= 2;
+    }
+    window = new char[size];
+    window_mask = size - 1;
+
+    switch (format) {
+        case FORMAT_RAW:
+            state = STATE_BLOCK;
+            break;
+        case FORMAT_ZLIB:
+            state = STATE_ZLIB_HEADER;
+            break;
+        case FORMAT_GZIP:
+            state = STATE_GZIP_HEADER;
+            break;
+        case FORMAT_DEFLATE:
+            state = STATE_DEFLATE_HEADER;
+            break;
+    }
+    checksum = format == FORMAT_GZIP ? 0 : 1;
+}
+
+
+AsyncHTTPRequest::Inflater::~Inflater() {
+    delete[] window;
+}
+
+
+bool AsyncHTTPRequest::Inflater::write(const char* data, size_t data_length) {
+    in = data;
+    in_end = data + data_length;
+
+    auto more = true;
+    while (more) {
+        if (output_failed) {
+            fail();
+        }
+        switch (state) {
+            case STATE_DEFLATE_HEADER: {
+                if (!need(16)) {
+                    more = false;
+                    break;
+                }
+                auto cmf = bit_buffer & 0xff;
+                auto flg = (bit_buffer >> 8) & 0xff;
+                if ((cmf & 0x0f) == 8 && (cmf >> 4) <= 7 && ((cmf << 8) | flg) % 31 == 0) {
+                    format = FORMAT_ZLIB;
+                    state = STATE_ZLIB_HEADER;
+                }
+                else {
+                    format = FORMAT_RAW;
+                    state = STATE_BLOCK;
+                }
+                break;
+            }
+
+            case STATE_ZLIB_HEADER: {
+                if (!need(16)) {
+                    more = false;
+                    break;
+                }
+                auto cmf = bits(8);
+                auto flg = bits(8);
+                if ((cmf & 0x0f) != 8 || ((cmf << 8) | flg) % 31 != 0 || (flg & 0x20) != 0) {
+                    // Not deflate, bad header check or preset dictionary.
+                    fail();
+                    break;
+                }
+                state = STATE_BLOCK;
+                break;
+            }
+
+            case STATE_GZIP_HEADER:
+                if (!need(8)) {
+                    more = false;
+                    break;
+                }
+                header[counter++] = bits(8);
+                if (counter == sizeof(header)) {
+                    // The reserved flags must be zero.
+                    if (header[0] != 0x1f || header[1] != 0x8b || header[2] != 8 || (header[3] & 0xe0) != 0) {
+                        fail();
+                        break;
+                    }
+                    gzip_flags = header[3];
+                    state = STATE_GZIP_FIELD;
+                }
+                break;
+
+            case STATE_GZIP_FIELD:
+                nextGzipField();
+                break;
+
+            case STATE_GZIP_EXTRA_LENGTH:
+                if (!need(16)) {
+                    more = false;
+                    break;
+                }
+                counter = bits(16);
+                state = STATE_GZIP_SKIP;
+                break;
+
+            case STATE_GZIP_SKIP:
+                while (counter > 0 && need(8)) {
+                    bits(8);
+                    counter -= 1;
+                }
+                if (counter > 0) {
+                    more = false;
+                    break;
+                }
+                state = STATE_GZIP_FIELD;
+                break;
+
+            case STATE_GZIP_STRING:
+                while (need(8)) {
+                    if (bits(8) == 0) {
+                        state = STATE_GZIP_FIELD;
+                        break;
+                    }
+                }
+                if (state == STATE_GZIP_STRING) {
+                    more = false;
+                }
+                break;
+
+            case STATE_BLOCK: {
+                if (!need(3)) {
+                    more = false;
+                    break;
+                }
+                last_block = bits(1);
+                switch (bits(2)) {
+                    case 0:
+                        bits(bit_count % 8);
+                        state = STATE_STORED_LENGTH;
+                        break;
+
+                    case 1:
+                        for (auto i = 0; i < 288; i++) {
+                            lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+                        }
+                        for (auto i = 0; i < 30; i++) {
+                            lengths[288 + i] = 5;
+                        }
+                        build(&literal_code, lengths, 288);
+                        build(&distance_code, lengths + 288, 30);
+                        state = STATE_CODES;
+                        break;
+
+                    case 2:
+                        state = STATE_TABLE;
+                        break;
+
+                    default:
+                        fail();
+                        break;
+                }
+                break;
+            }
+
+            case STATE_STORED_LENGTH:
+                if (!need(16)) {
+                    more = false;
+                    break;
+                }
+                length = bits(16);
+                state = STATE_STORED_COMPLEMENT;
+                break;
+
+            case STATE_STORED_COMPLEMENT:
+                if (!need(16)) {
+                    more = false;
+                    break;
+                }
+                if ((bits(16) ^ 0xffff) != length) {
+                    fail();
+                    break;
+                }
+                state = STATE_STORED;
+                break;
+
+            case STATE_STORED:
+                while (length > 0 && bit_count >= 8) {
+                    put(bits(8));
+                    length -= 1;
+                }
+                while (length > 0 && in < in_end) {
+                    put(*in++);
+                    length -= 1;
+                }
+                if (length > 0) {
+                    more = false;
+                    break;
+                }
+                endOfBlock();
+                break;
+
+            case STATE_TABLE:
+                if (!need(14)) {
+                    more = false;
+                    break;
+                }
+                code_count = bits(5) + 257;
+                distance_count = bits(5) + 1;
+                length = bits(4) + 4;
+                if (code_count > 286 || distance_count > 30) {
+                    fail();
+                    break;
+                }
+                counter = 0;
+                state = STATE_CODE_LENGTHS_CODE;
+                break;
+
+            case STATE_CODE_LENGTHS_CODE:
+                while (counter < 19) {
+                    if (counter < length) {
+                        if (!need(3)) {
+                            break;
+                        }
+                        lengths[code_length_order[counter]] = bits(3);
+                    }
+                    else {
+                        lengths[code_length_order[counter]] = 0;
+                    }
+                    counter += 1;
+                }
+                if (counter < 19) {
+                    more = false;
+                    break;
+                }
+                // The code for code lengths is kept in distance_code until the real tables are built.
+                if (!build(&distance_code, lengths, 19, true)) {
+                    fail();
+                    break;
+                }
+                counter = 0;
+                symbol = -1;
+                state = STATE_CODE_LENGTHS;
+                break;
+
+            case STATE_CODE_LENGTHS: {
+                auto total = code_count + distance_count;
+                while (counter < total) {
+                    if (symbol < 0) {
+                        auto value = decode(&distance_code);
+                        if (value < 0) {
+                            if (value == -2) {
+                                fail();
+                            }
+                            break;
+                        }
+                        if (value < 16) {
+                            lengths[counter++] = value;
+                            continue;
+                        }
+                        symbol = value;
+                    }
+
+                    uint8_t value = 0;
+                    size_t repeat;
+                    if (symbol == 16) {
+                        if (!need(2)) {
+                            break;
+                        }
+                        if (counter == 0) {
+                            fail();
+                            break;
+                        }
+                        value = lengths[counter - 1];
+                        repeat = 3 + bits(2);
+                    }
+                    else if (symbol == 17) {
+                        if (!need(3)) {
+                            break;
+                        }
+                        repeat = 3 + bits(3);
+                    }
+                    else {
+                        if (!need(7)) {
+                            break;
+                        }
+                        repeat = 11 + bits(7);
+                    }
+                    if (counter + repeat > total) {
+                        fail();
+                        break;
+                    }
+                    while (repeat-- > 0) {
+                        lengths[counter++] = value;
+                    }
+                    symbol = -1;
+                }
+                if (state == STATE_FAILED) {
+                    break;
+                }
+                if (counter < total) {
+                    more = false;
+                    break;
+                }
+                if (lengths[256] == 0 || !build(&literal_code, lengths, code_count) || !build(&distance_code, lengths + code_count, distance_count)) {
+                    fail();
+                    break;
+                }
+                state = STATE_CODES;
+                break;
+            }
+
+            case STATE_CODES: {
+                auto value = decode(&literal_code);
+                if (value < 0) {
+                    if (value == -2) {
+                        fail();
+                    }
+                    else {
+                        more = false;
+                    }
+                    break;
+                }
+                if (value < 256) {
+                    put(static_cast<char>(value));
+                }
+                else if (value == 256) {
+                    endOfBlock();
+                }
+                else if (value - 257 < 29) {
+                    symbol = value - 257;
+                    state = STATE_LENGTH_EXTRA;
+                }
+                else {
+                    fail();
+                }
+                break;
+            }
+
+            case STATE_LENGTH_EXTRA:
+                if (!need(length_extra[symbol])) {
+                    more = false;
+                    break;
+                }
+                length = length_base[symbol] + bits(length_extra[symbol]);
+                state = STATE_DISTANCE;
+                break;
+
+            case STATE_DISTANCE: {
+                auto value = decode(&distance_code);
+                if (value < 0) {
+                    if (value == -2) {
+                        fail();
+                    }
+                    else {
+                        more = false;
+                    }
+                    break;
+                }
+                if (value >= 30) {
+                    fail();
+                    break;
+                }
+                symbol = value;
+                state = STATE_DISTANCE_EXTRA;
+                break;
+            }
+
+            case STATE_DISTANCE_EXTRA: {
+                if (!need(distance_extra[symbol])) {
+                    more = false;
+                    break;
+                }
+                size_t distance = distance_base[symbol] + bits(distance_extra[symbol]);
+                if (distance > position || distance > window_mask + 1) {
+                    fail();
+                    break;
+                }
+                while (length > 0) {
+                    put(window[(position - distance) & window_mask]);
+                    length -= 1;
+                }
+                state = STATE_CODES;
+                break;
+            }
+
+            case STATE_TRAILER:
+                if (counter < (format == FORMAT_GZIP ? 8 : format == FORMAT_ZLIB ? 4 : 0)) {
+                    if (!need(8)) {
+                        more = false;
+                        break;
+                    }
+                    header[counter++] = bits(8);
+                    break;
+                }
+                if (!flush() || !checkTrailer()) {
+                    fail();
+                    break;
+                }
+                state = STATE_DONE;
+                break;
+
+            case STATE_DONE:
+                // Ignore anything after the end of the stream.
+                in = in_end;
+                more = false;
+                break;
+
+            case STATE_FAILED:
+                more = false;
+                break;
+        }
+    }
+
+    if (state != STATE_FAILED && !flush()) {
+        fail();
+    }
+    return state != STATE_FAILED && !output_failed;
+}
+
+
+bool AsyncHTTPRequest::Inflater::finish() {
+    return state == STATE_DONE && output->finish();
+}
+
+
+bool AsyncHTTPRequest::Inflater::need(unsigned int n) {
+    while (bit_count < n) {
+        if (in == in_end) {
+            return false;
+        }
+        bit_buffer |= static_cast<uint32_t>(static_cast<uint8_t>(*in++)) << bit_count;
+        bit_count += 8;
+    }
+    return true;
+}
+
+
+uint32_t AsyncHTTPRequest::Inflater::bits(unsigned int n) {
+    auto value = bit_buffer & ((1u << n) - 1);
+    bit_buffer >>= n;
+    bit_count -= n;
+    return value;
+}
+
+
+// Returns the decoded symbol, -1 if more input is needed, or -2 for an invalid code.
+int AsyncHTTPRequest::Inflater::decode(const Huffman* code) {
+    while (bit_count < 15 && in < in_end) {
+        bit_buffer |= static_cast<uint32_t>(static_cast<uint8_t>(*in++)) << bit_count;
+        bit_count += 8;
+    }
+
+    int value = 0;
+    int first = 0;
+    int index = 0;
+    for (unsigned int len = 1; len < 16; len++) {
+        if (len > bit_count) {
+            return -1;
+        }
+        value |= (bit_buffer >> (len - 1)) & 1;
+        int count = code->count[len];
+        if (value - count < first) {
+            bits(len);
+            return code->symbol[index + (value - first)];
+        }
+        index += count;
+        first += count;
+        first <<= 1;
+        value <<= 1;
+    }
+    return -2;
+}
+
+
+// Builds canonical Huffman code from code lengths. Returns false if the lengths are over-subscribed, or if they are
+// incomplete, which like zlib is only allowed for a single code of length 1 unless complete is true, and for no code.
+bool AsyncHTTPRequest::Inflater::build(Huffman* code, const uint8_t* lengths, size_t n, bool complete) {
+    uint16_t offsets[16];
+
+    memset(code->count, 0, sizeof(code->count));
+    for (size_t i = 0; i < n; i++) {
+        code->count[lengths[i]] += 1;
+    }
+
+    int left = 1;
+    for (auto len = 1; len < 16; len++) {
+        left <<= 1;
+        left -= code->count[len];
+        if (left < 0) {
+            return false;
+        }
+    }
+    auto codes = n - code->count[0];
+
+    code->count[0] = 0;
+    offsets[1] = 0;
+    for (auto len = 1; len < 15; len++) {
+        offsets[len + 1] = offsets[len] + code->count[len];
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (lengths[i] != 0) {
+            code->symbol[offsets[lengths[i]]++] = i;
+        }
+    }
+    // The fixed distance code is incomplete too, it is built anyway.
+    return left == 0 || codes == 0 || (!complete && codes == 1 && code->count[1] == 1);
+}
+
+
+void AsyncHTTPRequest::Inflater::put(char c) {
+    window[position & window_mask] = c;
+    position += 1;
+    if ((position & window_mask) == 0 && !flush()) {
+        output_failed = true;
+    }
+}
+
+
+// Pass output not yet passed on. This is called at least whenever the window wraps around.
+bool AsyncHTTPRequest::Inflater::flush() {
+    if (flushed == position) {
+        return true;
+    }
+
+    auto data = window + (flushed & window_mask);
+    auto n = position - flushed;
+    flushed = position;
+
+    if (format == FORMAT_GZIP) {
+        checksum = crc32(checksum, data, n);
+    }
+    else if (format == FORMAT_ZLIB) {
+        checksum = adler32(checksum, data, n);
+    }
+    return output->write(data, n);
+}
+
+
+void AsyncHTTPRequest::Inflater::nextGzipField() {
+    if (gzip_flags & GZIP_FLAG_EXTRA) {
+        gzip_flags &= ~GZIP_FLAG_EXTRA;
+        state = STATE_GZIP_EXTRA_LENGTH;
+    }
+    else if (gzip_flags & GZIP_FLAG_NAME) {
+        gzip_flags &= ~GZIP_FLAG_NAME;
+        state = STATE_GZIP_STRING;
+    }
+    else if (gzip_flags & GZIP_FLAG_COMMENT) {
+        gzip_flags &= ~GZIP_FLAG_COMMENT;
+        state = STATE_GZIP_STRING;
+    }
+    else if (gzip_flags & GZIP_FLAG_HCRC) {
+        gzip_flags &= ~GZIP_FLAG_HCRC;
+        counter = 2;
+        state = STATE_GZIP_SKIP;
+    }
+    else {
+        state = STATE_BLOCK;
+    }
+}
+
+
+void AsyncHTTPRequest::Inflater::endOfBlock() {
+    if (last_block) {
+        bits(bit_count % 8);
+        counter = 0;
+        state = STATE_TRAILER;
+    }
+    else {
+        state = STATE_BLOCK;
+    }
+}
+
+
+bool AsyncHTTPRequest::Inflater::checkTrailer() {
+    if (format == FORMAT_GZIP) {
+        auto crc = header[0] | (header[1] << 8) | (header[2] << 16) | (static_cast<uint32_t>(header[3]) << 24);
+        auto size = header[4] | (header[5] << 8) | (header[6] << 16) | (static_cast<uint32_t>(header[7]) << 24);
+        return crc == checksum && size == static_cast<uint32_t>(position);
+    }
+    else if (format == FORMAT_ZLIB) {
+        auto adler = (static_cast<uint32_t>(header[0]) << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+        return adler == checksum;
+    }
+    return true;
+}
+
+
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_HASH_BITS 11
+
+AsyncHTTPRequest::Deflater::Deflater(Sink* output, CompressionFormat format, size_t window_size): output(output), format(format == FORMAT_DEFLATE ? FORMAT_ZLIB : format) {
+    size_t size = 1024;
+    while (size < window_size && size < 16384) {
+        size *= 2;
+    }
+    this->window_size = size;
+    buffer = new char[2 * size];
+    hash_table = new uint16_t[1 << DEFLATE_HASH_BITS]();
+    checksum = this->format == FORMAT_GZIP ? 0 : 1;
+}
+
+
+size_t AsyncHTTPRequest::Deflater::memorySize() const {
+    return sizeof(*this) + 2 * window_size + sizeof(uint16_t) * (1 << DEFLATE_HASH_BITS);
+}
+
+
+AsyncHTTPRequest::Deflater::~Deflater() {
+    delete[] buffer;
+    delete[] hash_table;
+}
+
+
+bool AsyncHTTPRequest::Deflater::write(const char* data, size_t length) {
+    if (!started) {
+        begin();
+    }
+
+    if (format == FORMAT_GZIP) {
+        checksum = crc32(checksum, data, length);
+    }
+    else if (format == FORMAT_ZLIB) {
+        checksum = adler32(checksum, data, length);
+    }
+    total_in += length;
+
+    while (length > 0) {
+        if (end == 2 * window_size) {
+            slide();
+        }
+        auto n = 2 * window_size - end;
+        if (n > length) {
+            n = length;
+        }
+        memcpy(buffer + end, data, n);
+        end += n;
+        data += n;
+        length -= n;
+        compress(false);
+    }
+
+    return !failed;
+}
+
+
+bool AsyncHTTPRequest::Deflater::finish() {
+    if (!started) {
+        begin();
+    }
+
+    compress(true);
+
+    // End of block, followed by an empty final block.
+    putCode(0, 7);
+    putBits(1, 1);
+    putBits(1, 2);
+    putCode(0, 7);
+    if (bit_count > 0) {
+        putBits(0, 8 - bit_count);
+    }
+
+    if (format == FORMAT_GZIP) {
+        for (auto i = 0; i < 4; i++) {
+            putByte(checksum >> (8 * i));
+        }
+        for (auto i = 0; i < 4; i++) {
+            putByte(total_in >> (8 * i));
+        }
+    }
+    else if (format == FORMAT_ZLIB) {
+        for (auto i = 3; i >= 0; i--) {
+            putByte(checksum >> (8 * i));
+        }
+    }
+    flushOutput();
+
+    return !failed && output->finish();
+}
+
+
+void AsyncHTTPRequest::Deflater::begin() {
+    started = true;
+
+    if (format == FORMAT_GZIP) {
+        static const uint8_t header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff };
+        for (auto c : header) {
+            putByte(c);
+        }
+    }
+    else if (format == FORMAT_ZLIB) {
+        uint8_t cinfo = 0;
+        while ((256u << cinfo) < window_size) {
+            cinfo += 1;
+        }
+        uint8_t cmf = (cinfo << 4) | 8;
+        putByte(cmf);
+        putByte(31 - (cmf * 256) % 31);
+    }
+
+    // All data is written in one block with fixed codes.
+    putBits(0, 1);
+    putBits(1, 2);
+}
+
+
+void AsyncHTTPRequest::Deflater::compress(bool finishing) {
+    while (start < end && (finishing || end - start >= DEFLATE_MAX_MATCH)) {
+        size_t match_length = 0;
+        size_t match_distance = 0;
+
+        if (end - start >= DEFLATE_MIN_MATCH) {
+            auto p = reinterpret_cast<const uint8_t*>(buffer + start);
+            auto hash = ((p[0] | (p[1] << 8) | (p[2] << 16)) * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+            size_t candidate = hash_table[hash];
+            hash_table[hash] = start + 1;
+
+            if (candidate > 0 && start - (candidate - 1) <= window_size) {
+                auto q = reinterpret_cast<const uint8_t*>(buffer + candidate - 1);
+                auto max_length = end - start < DEFLATE_MAX_MATCH ? end - start : DEFLATE_MAX_MATCH;
+                while (match_length < max_length && p[match_length] == q[match_length]) {
+                    match_length += 1;
+                }
+                match_distance = start - (candidate - 1);
+            }
+        }
+
+        if (match_length >= DEFLATE_MIN_MATCH) {
+            putMatch(match_length, match_distance);
+            // Remember positions inside the match for later matches.
+            for (size_t i = 1; i < match_length && start + i + DEFLATE_MIN_MATCH <= end; i++) {
+                auto p = reinterpret_cast<const uint8_t*>(buffer + start + i);
+                hash_table[((p[0] | (p[1] << 8) | (p[2] << 16)) * 2654435761u) >> (32 - DEFLATE_HASH_BITS)] = start + i + 1;
+            }
+            start += match_length;
+        }
+        else {
+            putLiteral(buffer[start]);
+            start += 1;
+        }
+    }
+}
+
+
+// Moves the second half of buffer to the front. Only called when everything before it has been compressed.
+void AsyncHTTPRequest::Deflater::slide() {
+    memcpy(buffer, buffer + window_size, window_size);
+    start -= window_size;
+    end -= window_size;
+    for (size_t i = 0; i < (1 << DEFLATE_HASH_BITS); i++) {
+        hash_table[i] = hash_table[i] > window_size ? hash_table[i] - window_size : 0;
+    }
+}
+
+
+void AsyncHTTPRequest::Deflater::putBits(uint32_t value, unsigned int n) {
+    bit_buffer |= value << bit_count;
+    bit_count += n;
+    while (bit_count >= 8) {
+        putByte(bit_buffer & 0xff);
+        bit_buffer >>= 8;
+        bit_count -= 8;
+    }
+}
+
+
+// Huffman codes are stored starting with the most significant bit.
+void AsyncHTTPRequest::Deflater::putCode(uint32_t code, unsigned int n) {
+    uint32_t reversed = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        reversed = (reversed << 1) | ((code >> i) & 1);
+    }
+    putBits(reversed, n);
+}
+
+
+void AsyncHTTPRequest::Deflater::putLiteral(uint8_t c) {
+    if (c < 144) {
+        putCode(0x30 + c, 8);
+    }
+    else {
+        putCode(0x190 + c - 144, 9);
+    }
+}
+
+
+void AsyncHTTPRequest::Deflater::putMatch(size_t length, size_t distance) {
+    auto symbol = 28;
+    while (length_base[symbol] > length) {
+        symbol -= 1;
+    }
+    auto code = 257 + symbol;
+    if (code < 280) {
+        putCode(code - 256, 7);
+    }
+    else {
+        putCode(0xc0 + code - 280, 8);
+    }
+    putBits(length - length_base[symbol], length_extra[symbol]);
+
+    symbol = 29;
+    while (distance_base[symbol] > distance) {
+        symbol -= 1;
+    }
+    putCode(symbol, 5);
+    putBits(distance - distance_base[symbol], distance_extra[symbol]);
+}
+
+
+void AsyncHTTPRequest::Deflater::putByte(uint8_t c) {
+    out[out_length++] = c;
+    if (out_length == sizeof(out)) {
+        flushOutput();
+    }
+}
+
+
+void AsyncHTTPRequest::Deflater::flushOutput() {
+    if (out_length > 0) {
+        if (!output->write(out, out_length)) {
+            failed = true;
+        }
+        out_length = 0;
+    }
+}
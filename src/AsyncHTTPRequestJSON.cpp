@@ -0,0 +1,415 @@
+/*
+ Copyright (C) Dieter Baron
+
+  This file is part of AsyncHTTPRequest, a library for making HTTP requests on ESP32.
+  The authors can be contacted at <dillo@nih.at>.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+  1. Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+  2. The names of the authors may not be used to endorse or promote
+     products derived from this software without specific prior
+     written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE AUTHORS ``AS IS'' AND ANY EXPRESS
+  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY
+  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+  GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+  IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+  IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "AsyncHTTPRequest.h"
+
+// JSON as described in RFC 8259.
+
+static bool isWhitespace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+
+static bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+
+static bool isNumber(const std::string& s) {
+    size_t i = 0;
+    auto n = s.size();
+
+    if (i < n && s[i] == '-') {
+        i += 1;
+    }
+    if (i < n && s[i] == '0') {
+        i += 1;
+    }
+    else if (i < n && isDigit(s[i])) {
+        while (i < n && isDigit(s[i])) {
+            i += 1;
+        }
+    }
+    else {
+        return false;
+    }
+    if (i < n && s[i] == '.') {
+        i += 1;
+        if (i == n || !isDigit(s[i])) {
+            return false;
+        }
+        while (i < n && isDigit(s[i])) {
+            i += 1;
+        }
+    }
+    if (i < n && (s[i] == 'e' || s[i] == 'E')) {
+        i += 1;
+        if (i < n && (s[i] == '+' || s[i] == '-')) {
+            i += 1;
+        }
+        if (i == n || !isDigit(s[i])) {
+            return false;
+        }
+        while (i < n && isDigit(s[i])) {
+            i += 1;
+        }
+    }
+    return i == n;
+}
+
+
+AsyncHTTPRequest::JSONSink::JSONSink(Handler handler, size_t max_depth, size_t max_path, size_t max_value): handler(handler), max_depth(max_depth), max_path(max_path), max_value(max_value) {
+    // Allocate everything up front, so memory use does not depend on the document.
+    levels.reserve(max_depth);
+    path.reserve(max_path);
+    value.reserve(max_value);
+}
+
+
+bool AsyncHTTPRequest::JSONSink::write(const char* data, size_t length) {
+    for (size_t i = 0; i < length && state != STATE_ERROR; i++) {
+        if (!process(data[i])) {
+            state = STATE_ERROR;
+        }
+    }
+
+    return state != STATE_ERROR;
+}
+
+
+bool AsyncHTTPRequest::JSONSink::finish() {
+    // A number or literal at the top level only ends with the document.
+    if ((state == STATE_NUMBER || state == STATE_LITERAL) && levels.empty()) {
+        if (!endScalar()) {
+            state = STATE_ERROR;
+        }
+    }
+
+    return state == STATE_DONE;
+}
+
+
+bool AsyncHTTPRequest::JSONSink::process(char c) {
+    switch (state) {
+        case STATE_VALUE:
+            if (isWhitespace(c)) {
+                return true;
+            }
+            if (c == ']' && container_start) {
+                return closeContainer(c);
+            }
+            return beginValue(c);
+
+        case STATE_KEY:
+            if (isWhitespace(c)) {
+                return true;
+            }
+            if (c == '}' && container_start) {
+                return closeContainer(c);
+            }
+            if (c != '"') {
+                return false;
+            }
+            value.clear();
+            in_key = true;
+            state = STATE_STRING;
+            return true;
+
+        case STATE_COLON:
+            if (isWhitespace(c)) {
+                return true;
+            }
+            if (c != ':') {
+                return false;
+            }
+            container_start = false;
+            state = STATE_VALUE;
+            return true;
+
+        case STATE_AFTER_VALUE:
+            if (isWhitespace(c)) {
+                return true;
+            }
+            if (c == ',') {
+                container_start = false;
+                if (levels.back().array) {
+                    levels.back().index += 1;
+                    state = STATE_VALUE;
+                }
+                else {
+                    state = STATE_KEY;
+                }
+                return true;
+            }
+            return closeContainer(c);
+
+        case STATE_STRING:
+            if (high_surrogate != 0 && c != '\\') {
+                return false;
+            }
+            if (c == '"') {
+                return endString();
+            }
+            if (c == '\\') {
+                state = STATE_ESCAPE;
+                return true;
+            }
+            if (static_cast<uint8_t>(c) < 0x20) {
+                return false;
+            }
+            return append(c);
+
+        case STATE_ESCAPE:
+            if (high_surrogate != 0 && c != 'u') {
+                return false;
+            }
+            state = STATE_STRING;
+            switch (c) {
+                case '"':
+                case '\\':
+                case '/':
+                    return append(c);
+                case 'b':
+                    return append('\b');
+                case 'f':
+                    return append('\f');
+                case 'n':
+                    return append('\n');
+                case 'r':
+                    return append('\r');
+                case 't':
+                    return append('\t');
+                case 'u':
+                    code_point = 0;
+                    unicode_digits = 0;
+                    state = STATE_UNICODE;
+                    return true;
+                default:
+                    return false;
+            }
+
+        case STATE_UNICODE:
+            code_point <<= 4;
+            if (isDigit(c)) {
+                code_point |= c - '0';
+            }
+            else if (c >= 'a' && c <= 'f') {
+                code_point |= c - 'a' + 10;
+            }
+            else if (c >= 'A' && c <= 'F') {
+                code_point |= c - 'A' + 10;
+            }
+            else {
+                return false;
+            }
+            unicode_digits += 1;
+            if (unicode_digits < 4) {
+                return true;
+            }
+            state = STATE_STRING;
+            return appendCodePoint(code_point);
+
+        case STATE_NUMBER:
+        case STATE_LITERAL:
+            if (isDigit(c) || (c >= 'a' && c <= 'z') || c == 'E' || c == '.' || c == '+' || c == '-') {
+                return append(c);
+            }
+            // The character after the value still has to be processed.
+            return endScalar() && process(c);
+
+        case STATE_DONE:
+            return isWhitespace(c);
+
+        case STATE_ERROR:
+            return false;
+    }
+
+    return false;
+}
+
+
+bool AsyncHTTPRequest::JSONSink::beginValue(char c) {
+    if (!levels.empty() && levels.back().array) {
+        path.resize(levels.back().path_length);
+        path += '/';
+        path += std::to_string(levels.back().index);
+        if (path.size() > max_path) {
+            return false;
+        }
+    }
+    value.clear();
+
+    switch (c) {
+        case '{':
+        case '[':
+            if (levels.size() == max_depth) {
+                return false;
+            }
+            emit(c == '{' ? OBJECT_BEGIN : ARRAY_BEGIN);
+            levels.push_back(Level{c == '[', 0, path.size()});
+            container_start = true;
+            state = c == '{' ? STATE_KEY : STATE_VALUE;
+            return true;
+
+        case '"':
+            in_key = false;
+            state = STATE_STRING;
+            return true;
+
+        case 't':
+        case 'f':
+        case 'n':
+            state = STATE_LITERAL;
+            return append(c);
+
+        default:
+            if (c == '-' || isDigit(c)) {
+                state = STATE_NUMBER;
+                return append(c);
+            }
+            return false;
+    }
+}
+
+
+bool AsyncHTTPRequest::JSONSink::endString() {
+    if (high_surrogate != 0) {
+        // Unpaired surrogate.
+        return false;
+    }
+
+    if (in_key) {
+        path.resize(levels.back().path_length);
+        path += '/';
+        for (auto c : value) {
+            if (c == '~') {
+                path += "~0";
+            }
+            else if (c == '/') {
+                path += "~1";
+            }
+            else {
+                path += c;
+            }
+        }
+        if (path.size() > max_path) {
+            return false;
+        }
+        state = STATE_COLON;
+    }
+    else {
+        emit(STRING);
+        endValue();
+    }
+    return true;
+}
+
+
+bool AsyncHTTPRequest::JSONSink::endScalar() {
+    if (state == STATE_NUMBER) {
+        if (!isNumber(value)) {
+            return false;
+        }
+        emit(NUMBER);
+    }
+    else if (value == "true" || value == "false") {
+        emit(BOOLEAN);
+    }
+    else if (value == "null") {
+        emit(NULL_VALUE);
+    }
+    else {
+        return false;
+    }
+    endValue();
+    return true;
+}
+
+
+bool AsyncHTTPRequest::JSONSink::closeContainer(char c) {
+    if (levels.empty() || c != (levels.back().array ? ']' : '}')) {
+        return false;
+    }
+
+    path.resize(levels.back().path_length);
+    value.clear();
+    emit(levels.back().array ? ARRAY_END : OBJECT_END);
+    levels.pop_back();
+    endValue();
+    return true;
+}
+
+
+void AsyncHTTPRequest::JSONSink::endValue() {
+    container_start = false;
+    state = levels.empty() ? STATE_DONE : STATE_AFTER_VALUE;
+}
+
+
+bool AsyncHTTPRequest::JSONSink::append(char c) {
+    if (value.size() == max_value) {
+        return false;
+    }
+    value += c;
+    return true;
+}
+
+
+// Appends code point from a \u escape as UTF-8, combining surrogate pairs.
+bool AsyncHTTPRequest::JSONSink::appendCodePoint(uint32_t code_point) {
+    if (code_point >= 0xd800 && code_point < 0xdc00) {
+        if (high_surrogate != 0) {
+            return false;
+        }
+        high_surrogate = code_point;
+        return true;
+    }
+    if (code_point >= 0xdc00 && code_point < 0xe000) {
+        if (high_surrogate == 0) {
+            return false;
+        }
+        code_point = 0x10000 + ((high_surrogate - 0xd800) << 10) + (code_point - 0xdc00);
+        high_surrogate = 0;
+    }
+    else if (high_surrogate != 0) {
+        return false;
+    }
+
+    if (code_point < 0x80) {
+        return append(code_point);
+    }
+    else if (code_point < 0x800) {
+        return append(0xc0 | (code_point >> 6)) && append(0x80 | (code_point & 0x3f));
+    }
+    else if (code_point < 0x10000) {
+        return append(0xe0 | (code_point >> 12)) && append(0x80 | ((code_point >> 6) & 0x3f)) && append(0x80 | (code_point & 0x3f));
+    }
+    else {
+        return append(0xf0 | (code_point >> 18)) && append(0x80 | ((code_point >> 12) & 0x3f)) && append(0x80 | ((code_point >> 6) & 0x3f)) && append(0x80 | (code_point & 0x3f));
+    }
+}
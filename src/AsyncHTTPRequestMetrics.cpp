@@ -0,0 +1,256 @@
+/*
+ Copyright (C) Dieter Baron
+
+  This file is part of AsyncHTTPRequest, a library for making HTTP requests on ESP32.
+  The authors can be contacted at <dillo@nih.at>.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+  1. Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+  2. The names of the authors may not be used to endorse or promote
+     products derived from this software without specific prior
+     written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE AUTHORS ``AS IS'' AND ANY EXPRESS
+  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY
+  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+  GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+  IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+  IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "AsyncHTTPRequest.h"
+
+AsyncHTTPRequest::Metrics AsyncHTTPRequest::metrics;
+AsyncHTTPRequest::MemoryUsage AsyncHTTPRequest::memory;
+
+const uint32_t AsyncHTTPRequest::Metrics::bucket_bounds[BUCKET_COUNT - 1] = {
+    10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000
+};
+
+static const char* counter_names[AsyncHTTPRequest::Metrics::COUNTER_COUNT] = {
+    "http_requests_started_total",
+    "http_requests_completed_total",
+    "http_requests_failed_total",
+    "http_connections_total",
+    "http_resumes_total",
+    "http_cache_hits_total",
+    "http_sent_bytes_total",
+    "http_received_bytes_total",
+    "http_delayed_acks_total"
+};
+
+static const char* gauge_names[AsyncHTTPRequest::Metrics::GAUGE_COUNT] = {
+    "http_buffer_high_water_bytes"
+};
+
+static const char* histogram_names[AsyncHTTPRequest::Metrics::HISTOGRAM_COUNT] = {
+    "http_connect_milliseconds",
+    "http_first_byte_milliseconds",
+    "http_duration_milliseconds"
+};
+
+static const char* error_names[] = {
+    "ok",
+    "scheme",
+    "in_use",
+    "cannot_connect",
+    "timeout",
+    "connection_closed",
+    "cache",
+    "write",
+    "decode",
+    "protocol",
+    "aborted"
+};
+
+
+void AsyncHTTPRequest::Metrics::maximum(Gauge gauge, uint32_t value) {
+    auto current = gauges[gauge].load(std::memory_order_relaxed);
+    while (value > current && !gauges[gauge].compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+}
+
+
+void AsyncHTTPRequest::Metrics::observe(Histogram histogram, uint32_t value) {
+    size_t index = 0;
+    while (index < BUCKET_COUNT - 1 && value > bucket_bounds[index]) {
+        index += 1;
+    }
+    histograms[histogram].buckets[index].fetch_add(1, std::memory_order_relaxed);
+    histograms[histogram].sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+
+void AsyncHTTPRequest::Metrics::failed(Error error) {
+    count(REQUESTS_FAILED);
+    if (error < ERROR_COUNT) {
+        errors[error].fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+
+void AsyncHTTPRequest::Metrics::finished(const Timing& timing) {
+    if (timing.started == 0) {
+        return;
+    }
+    if (timing.connected != 0) {
+        observe(CONNECT_TIME, (timing.connected - timing.started) / 1000);
+    }
+    if (timing.status_received != 0) {
+        observe(FIRST_BYTE_TIME, (timing.status_received - timing.started) / 1000);
+    }
+    observe(DURATION, (timing.finished - timing.started) / 1000);
+}
+
+
+void AsyncHTTPRequest::Metrics::reset() {
+    for (auto& counter : counters) {
+        counter = 0;
+    }
+    for (auto& gauge : gauges) {
+        gauge = 0;
+    }
+    for (auto& error : errors) {
+        error = 0;
+    }
+    for (auto& histogram : histograms) {
+        for (auto& bucket : histogram.buckets) {
+            bucket = 0;
+        }
+        histogram.sum = 0;
+    }
+}
+
+
+size_t AsyncHTTPRequest::Metrics::binarySize() {
+    return 4 + 4 * (static_cast<size_t>(COUNTER_COUNT) + GAUGE_COUNT + ERROR_COUNT + HISTOGRAM_COUNT * (BUCKET_COUNT + 1));
+}
+
+
+// Header: 'H', format version, number of counters, number of histograms.
+size_t AsyncHTTPRequest::Metrics::exportBinary(uint8_t* data, size_t length) const {
+    if (length < binarySize()) {
+        return 0;
+    }
+
+    auto p = data;
+    *p++ = 'H';
+    *p++ = 1;
+    *p++ = COUNTER_COUNT;
+    *p++ = HISTOGRAM_COUNT;
+
+    auto put = [&p](uint32_t value) {
+        for (auto i = 0; i < 4; i++) {
+            *p++ = value >> (8 * i);
+        }
+    };
+
+    for (auto& counter : counters) {
+        put(counter);
+    }
+    for (auto& gauge : gauges) {
+        put(gauge);
+    }
+    for (auto& error : errors) {
+        put(error);
+    }
+    for (auto& histogram : histograms) {
+        for (auto& bucket : histogram.buckets) {
+            put(bucket);
+        }
+        put(histogram.sum);
+    }
+
+    return p - data;
+}
+
+
+void AsyncHTTPRequest::Metrics::exportPrometheus(Print& output) const {
+    for (size_t i = 0; i < COUNTER_COUNT; i++) {
+        output.print("# TYPE ");
+        output.print(counter_names[i]);
+        output.print(" counter\n");
+        if (i == REQUESTS_FAILED) {
+            for (size_t error = 1; error < sizeof(error_names) / sizeof(error_names[0]); error++) {
+                output.print(counter_names[i]);
+                output.print("{error=\"");
+                output.print(error_names[error]);
+                output.print("\"} ");
+                output.print(errors[error].load());
+                output.print("\n");
+            }
+        }
+        else {
+            output.print(counter_names[i]);
+            output.print(" ");
+            output.print(counters[i].load());
+            output.print("\n");
+        }
+    }
+
+    for (size_t i = 0; i < GAUGE_COUNT; i++) {
+        output.print("# TYPE ");
+        output.print(gauge_names[i]);
+        output.print(" gauge\n");
+        output.print(gauge_names[i]);
+        output.print(" ");
+        output.print(gauges[i].load());
+        output.print("\n");
+    }
+
+    for (size_t i = 0; i < HISTOGRAM_COUNT; i++) {
+        output.print("# TYPE ");
+        output.print(histogram_names[i]);
+        output.print(" histogram\n");
+        uint32_t total = 0;
+        for (size_t bucket = 0; bucket < BUCKET_COUNT; bucket++) {
+            total += histograms[i].buckets[bucket];
+            output.print(histogram_names[i]);
+            output.print("_bucket{le=\"");
+            if (bucket < BUCKET_COUNT - 1) {
+                output.print(bucket_bounds[bucket]);
+            }
+            else {
+                output.print("+Inf");
+            }
+            output.print("\"} ");
+            output.print(total);
+            output.print("\n");
+        }
+        output.print(histogram_names[i]);
+        output.print("_sum ");
+        output.print(histograms[i].sum.load());
+        output.print("\n");
+        output.print(histogram_names[i]);
+        output.print("_count ");
+        output.print(total);
+        output.print("\n");
+    }
+}
+
+
+void AsyncHTTPRequest::MemoryUsage::allocated(size_t length) {
+    auto now = current_bytes.fetch_add(length, std::memory_order_relaxed) + length;
+    auto highest = peak_bytes.load(std::memory_order_relaxed);
+    while (now > highest && !peak_bytes.compare_exchange_weak(highest, now, std::memory_order_relaxed)) {
+    }
+    if (parent != nullptr) {
+        parent->allocated(length);
+    }
+}
+
+
+void AsyncHTTPRequest::MemoryUsage::released(size_t length) {
+    current_bytes.fetch_sub(length, std::memory_order_relaxed);
+    if (parent != nullptr) {
+        parent->released(length);
+    }
+}
@@ -0,0 +1,168 @@
+/*
+ Copyright (C) Dieter Baron
+
+  This file is part of AsyncHTTPRequest, a library for making HTTP requests on ESP32.
+  The authors can be contacted at <dillo@nih.at>.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+  1. Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+  2. The names of the authors may not be used to endorse or promote
+     products derived from this software without specific prior
+     written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE AUTHORS ``AS IS'' AND ANY EXPRESS
+  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY
+  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+  GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+  IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+  IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "AsyncHTTPRequest.h"
+
+static const char* event_names[] = {
+    "none",
+    "connecting",
+    "resuming",
+    "tcp ack",
+    "tcp connected",
+    "tcp data",
+    "tcp disconnected",
+    "tcp error",
+    "tcp timeout",
+    "completed by disconnect",
+    "closed prematurely",
+    "request error",
+    "status",
+    "header line",
+    "end of headers",
+    "cannot resume",
+    "not modified",
+    "content length",
+    "content type",
+    "chunked",
+    "body data",
+    "ack delayed",
+    "ack sent",
+    "reader woken",
+    "request complete",
+    "cache too large",
+    "cache write failed",
+    "cache store",
+    "sending",
+    "sending body",
+    "receiving response",
+    "partition full",
+    "part start",
+    "part bad status",
+    "ranges unsupported",
+    "part bad range",
+    "cache evict",
+    "cache directory failed",
+    "cache evict file",
+    "cache file failed",
+    "notification",
+    "executor failed",
+    "coroutine resumed",
+    "null mutex",
+    "reader created",
+    "reader end",
+    "reader timeout",
+    "reader waiting"
+};
+static_assert(sizeof(event_names) / sizeof(event_names[0]) == AsyncHTTPRequest::Trace::EVENT_COUNT, "event names don't match events");
+
+static std::atomic<uint16_t> next_request_id{1};
+
+#ifdef HTTP_TRACE
+static AsyncHTTPRequest::Trace::Record records[HTTP_TRACE_SIZE];
+static std::atomic<uint32_t> next_record{0};
+#endif
+
+
+void AsyncHTTPRequest::Trace::record(uint16_t request, Event event, int32_t arg1, int32_t arg2, Print* echo) {
+    auto record = Record{static_cast<uint32_t>(micros()), static_cast<uint16_t>(event), request, arg1, arg2};
+#ifdef HTTP_TRACE
+    records[next_record.fetch_add(1, std::memory_order_relaxed) & (HTTP_TRACE_SIZE - 1)] = record;
+#endif
+    if (echo != nullptr) {
+        print(*echo, record);
+    }
+}
+
+
+void AsyncHTTPRequest::Trace::dump(Print& output) {
+#ifdef HTTP_TRACE
+    uint32_t end = next_record;
+    uint32_t start = end > HTTP_TRACE_SIZE ? end - HTTP_TRACE_SIZE : 0;
+    uint8_t header[8] = {'H', 'T', 'R', 'C', 1, sizeof(Record), static_cast<uint8_t>(end - start), static_cast<uint8_t>((end - start) >> 8)};
+    output.write(header, sizeof(header));
+
+    for (auto i = start; i < end; i++) {
+        auto& record = records[i & (HTTP_TRACE_SIZE - 1)];
+        uint8_t data[sizeof(Record)];
+        uint32_t values[] = {record.time, record.event | static_cast<uint32_t>(record.request) << 16, static_cast<uint32_t>(record.arg1), static_cast<uint32_t>(record.arg2)};
+        for (size_t j = 0; j < sizeof(data); j++) {
+            data[j] = values[j / 4] >> (8 * (j % 4));
+        }
+        output.write(data, sizeof(data));
+    }
+#else
+    uint8_t header[8] = {'H', 'T', 'R', 'C', 1, sizeof(Record), 0, 0};
+    output.write(header, sizeof(header));
+#endif
+}
+
+
+void AsyncHTTPRequest::Trace::print(Print& output) {
+#ifdef HTTP_TRACE
+    uint32_t end = next_record;
+    uint32_t start = end > HTTP_TRACE_SIZE ? end - HTTP_TRACE_SIZE : 0;
+
+    for (auto i = start; i < end; i++) {
+        print(output, records[i & (HTTP_TRACE_SIZE - 1)]);
+    }
+#else
+    (void)output;
+#endif
+}
+
+
+void AsyncHTTPRequest::Trace::clear() {
+#ifdef HTTP_TRACE
+    next_record = 0;
+#endif
+}
+
+
+const char* AsyncHTTPRequest::Trace::name(Event event) {
+    if (event >= EVENT_COUNT) {
+        return "unknown";
+    }
+    return event_names[event];
+}
+
+
+uint16_t AsyncHTTPRequest::Trace::newRequestId() {
+    auto id = next_request_id.fetch_add(1, std::memory_order_relaxed);
+    if (id == 0) {
+        // 0 is used for events not belonging to a request.
+        id = next_request_id.fetch_add(1, std::memory_order_relaxed);
+    }
+    return id;
+}
+
+
+void AsyncHTTPRequest::Trace::print(Print& output, const Record& record) {
+    char line[96];
+    snprintf(line, sizeof(line), "HTTP: %10u #%u %s %d %d", static_cast<unsigned int>(record.time), record.request, name(static_cast<Event>(record.event)), static_cast<int>(record.arg1), static_cast<int>(record.arg2));
+    output.println(line);
+}